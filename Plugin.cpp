@@ -1,3 +1,4 @@
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/OptimizationLevel.h"
@@ -8,9 +9,14 @@
 #include "llvm/Passes/PassPlugin.h"
 #endif
 #include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/TimeProfiler.h"
 
 #include "bogus/BogusControlFlow.h"
+#include "budget/Budget.h"
+#include "cache/FunctionCache.h"
 #include "flattening/Flattening.h"
+#include "lto/LinkTime.h"
+#include "report/Report.h"
 #include "split/SplitBasicBlocks.h"
 #include "substitution/Substitution.h"
 #include "utils/CryptoUtils.h"
@@ -46,6 +52,8 @@ bool addPassWithName(FunctionPassManager &FPM, StringRef &passName) {
 bool addPassWithName(ModulePassManager &MPM, StringRef &passName) {
   if (passName == "string-encryption") {
     MPM.addPass(StringObfuscatorPass());
+  } else if (passName == "string-encryption-lto") {
+    MPM.addPass(StringObfuscatorPass(/*linkTime=*/true));
   } else {
     return false;
   }
@@ -53,15 +61,150 @@ bool addPassWithName(ModulePassManager &MPM, StringRef &passName) {
   return true;
 }
 
-template <class T>
-void addPassesFromEnvVar(PassManager<T> &M, const StringRef &var) {
+// Runs the passes through the function cache as a single pipeline, or
+// directly if the cache is disabled
+bool addCachedPasses(FunctionPassManager &FPM, ArrayRef<StringRef> passes) {
+  bool enabled = !getCacheDir().empty();
+
+  FunctionPassManager cached;
+  for (auto passName : passes) {
+    if (!addPassWithName(enabled ? cached : FPM, passName)) {
+      return false;
+    }
+  }
+  if (enabled && !passes.empty()) {
+    FPM.addPass(FunctionCachePass(join(passes, ","), std::move(cached)));
+  }
+
+  return true;
+}
+
+// LLVM_OBF_LTO_PASSES enables the link-time stage, which needs the full LTO
+// extension point of LLVM 15
+bool hasLinkTimeStage() {
+#if LLVM_VERSION_MAJOR >= 15
+  return !getEnvVar(EnvVarPrefix + "LTO_PASSES").empty();
+#else
+  return false;
+#endif
+}
+
+// Whether the link-time stage runs the pass
+bool isLinkTimePass(StringRef passName) {
+  if (!hasLinkTimeStage()) {
+    return false;
+  }
+  SmallVector<StringRef> passes;
+  getEnvVar(EnvVarPrefix + "LTO_PASSES")
+      .split(passes, PassesDelimiter, -1, false);
+  return llvm::any_of(passes,
+                      [&](StringRef name) { return name.trim() == passName; });
+}
+
+// With string-encryption in the link-time stage, the strings are left to it,
+// which merges the copies of the translation units, when it follows the
+// compilation
+void addPassesFromEnvVar(ModulePassManager &MPM, const StringRef &var,
+                         std::shared_ptr<const LTOPhase> phase) {
   auto passesStr = getEnvVar(var);
 
   SmallVector<StringRef> passes;
   passesStr.split(passes, PassesDelimiter, -1, false);
   for (auto passName : passes) {
-    addPassWithName(M, passName);
+    if (passName == "string-encryption" && isLinkTimePass(passName)) {
+      ModulePassManager deferred;
+      addPassWithName(deferred, passName);
+      MPM.addPass(LTODeferModulePass(std::move(deferred), phase));
+      continue;
+    }
+    addPassWithName(MPM, passName);
+  }
+}
+
+// Whether the link-time stage runs function passes, the module passes being
+// the only ones addPassWithName adds to a module pass manager
+bool hasLinkTimeFunctionPasses() {
+  if (!hasLinkTimeStage()) {
+    return false;
+  }
+  SmallVector<StringRef> passes;
+  getEnvVar(EnvVarPrefix + "LTO_PASSES")
+      .split(passes, PassesDelimiter, -1, false);
+  ModulePassManager MPM;
+  return llvm::any_of(passes, [&](StringRef name) {
+    return !addPassWithName(MPM, name);
+  });
+}
+
+// With function passes in the link-time stage, the linkonce_odr functions are
+// left to it when a link-time stage follows the compilation
+void addPassesFromEnvVar(FunctionPassManager &FPM, const StringRef &var,
+                         std::shared_ptr<const LTOPhase> phase) {
+  auto passesStr = getEnvVar(var);
+
+  SmallVector<StringRef> passes;
+  passesStr.split(passes, PassesDelimiter, -1, false);
+  if (!hasLinkTimeFunctionPasses() || passes.empty()) {
+    addCachedPasses(FPM, passes);
+    return;
   }
+
+  FunctionPassManager deferred;
+  addCachedPasses(deferred, passes);
+  FPM.addPass(LTODeferPass(std::move(deferred), std::move(phase)));
+}
+
+// The function passes of the extension points, which the budget is
+// allocated to
+SmallVector<StringRef> getBudgetedPasses() {
+  SmallVector<StringRef> passes;
+  for (const char *point :
+       {"PEEPHOLE", "SCALAROPTIMIZERLATE", "VECTORIZERSTART", "LTO"}) {
+    getEnvVar(EnvVarPrefix + point + "_PASSES")
+        .split(passes, PassesDelimiter, -1, false);
+  }
+  for (StringRef &passName : passes) {
+    passName = passName.trim();
+  }
+  return passes;
+}
+
+// The budget is allocated once the IR is simplified, before the function
+// passes of the extension points run
+void addBudgetAnalysis(ModulePassManager &MPM) {
+  if (isBudgetEnabled()) {
+    MPM.addPass(RequireAnalysisPass<ObfuscationBudgetAnalysis, Module>());
+  }
+}
+
+// The function passes run first, on the functions deferred at compile time,
+// then the module passes. The resume pass runs even without function passes,
+// so that no function keeps the attribute of the deferral.
+void addLinkTimePasses(ModulePassManager &MPM) {
+  auto passesStr = getEnvVar(EnvVarPrefix + "LTO_PASSES");
+
+  SmallVector<StringRef> passes;
+  passesStr.split(passes, PassesDelimiter, -1, false);
+
+  SmallVector<StringRef> functionPasses;
+  ModulePassManager modulePasses;
+  for (auto passName : passes) {
+    if (passName == "string-encryption") {
+      passName = "string-encryption-lto";
+    }
+    if (!addPassWithName(modulePasses, passName)) {
+      functionPasses.push_back(passName);
+    }
+  }
+
+  FunctionPassManager FPM;
+  if (!functionPasses.empty()) {
+    addBudgetAnalysis(MPM);
+    addCachedPasses(FPM, functionPasses);
+  }
+  MPM.addPass(
+      createModuleToFunctionPassAdaptor(LTOResumePass(std::move(FPM))));
+  MPM.addPass(std::move(modulePasses));
 }
 
 extern "C" PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK llvmGetPassPluginInfo() {
@@ -82,68 +225,133 @@ extern "C" PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK llvmGetPassPluginInfo() {
     outs() << "\n";
   }
 
+#if LLVM_VERSION_MAJOR < 15
+  if (!getEnvVar(EnvVarPrefix + "LTO_PASSES").empty()) {
+    errs() << "LLVM_OBF_LTO_PASSES: the link-time stage needs LLVM 15, "
+              "ignored\n";
+  }
+#endif
+
   /* Register LLVM passes */
   return {
       LLVM_PLUGIN_API_VERSION, "Obfuscator plugin", "v0.1",
       [](PassBuilder &PB) {
+        // Phase of the pipeline being built, for the link-time deferral
+        auto phase = std::make_shared<LTOPhase>();
+
+        if (PassInstrumentationCallbacks *PIC =
+                PB.getPassInstrumentationCallbacks()) {
+          registerObfuscationReport(*PIC);
+
+          // The random pool refills show up in the time trace with the unit
+          // of the pass they are drawn for
+          PIC->registerBeforeNonSkippedPassCallback([](StringRef, Any IR) {
+            if (timeTraceProfilerEnabled()) {
+              CryptoUtils::set_trace_detail(getUnitName(IR));
+            }
+          });
+        }
+
         PB.registerPipelineParsingCallback(
             [](StringRef Name, FunctionPassManager &FPM,
-               ArrayRef<PassBuilder::PipelineElement>) {
-              return addPassWithName(FPM, Name);
+               ArrayRef<PassBuilder::PipelineElement> InnerPipeline) {
+              if (Name != "obf-cache") {
+                return addPassWithName(FPM, Name);
+              }
+
+              // obf-cache(pass1,pass2,...) runs the obfuscation passes
+              // through the function cache as a whole
+              SmallVector<StringRef> passes;
+              for (const auto &Element : InnerPipeline) {
+                if (!Element.InnerPipeline.empty()) {
+                  return false;
+                }
+                passes.push_back(Element.Name);
+              }
+              return !passes.empty() && addCachedPasses(FPM, passes);
             });
 
         PB.registerPipelineParsingCallback(
             [](StringRef Name, ModulePassManager &MPM,
                ArrayRef<PassBuilder::PipelineElement>) {
+              // obf-budget allocates the budget to the function passes
+              // that follow
+              if (Name == "obf-budget") {
+                MPM.addPass(
+                    RequireAnalysisPass<ObfuscationBudgetAnalysis, Module>());
+                return true;
+              }
               return addPassWithName(MPM, Name);
             });
 
+        PB.registerAnalysisRegistrationCallback(
+            [](ModuleAnalysisManager &MAM) {
+              MAM.registerPass([] {
+                return ObfuscationBudgetAnalysis(getBudgetedPasses());
+              });
+            });
+
         // Add passes that perform peephole optimizations similar to the
         // instruction combiner. These passes will be inserted after each
         // instance of the instruction combiner pass.
         PB.registerPeepholeEPCallback(
-            [](FunctionPassManager &FPM, OptimizationLevel O) {
-              addPassesFromEnvVar(FPM, EnvVarPrefix + "PEEPHOLE_PASSES");
+            [phase](FunctionPassManager &FPM, OptimizationLevel O) {
+              addPassesFromEnvVar(FPM, EnvVarPrefix + "PEEPHOLE_PASSES", phase);
             });
 
         // Add optimization passes after most of the main optimizations, but
         // before the last cleanup-ish optimizations.
         PB.registerScalarOptimizerLateEPCallback(
-            [](FunctionPassManager &FPM, OptimizationLevel O) {
-              addPassesFromEnvVar(FPM,
-                                  EnvVarPrefix + "SCALAROPTIMIZERLATE_PASSES");
+            [phase](FunctionPassManager &FPM, OptimizationLevel O) {
+              addPassesFromEnvVar(
+                  FPM, EnvVarPrefix + "SCALAROPTIMIZERLATE_PASSES", phase);
             });
 
         // Add optimization passes before the vectorizer and other highly target
         // specific optimization passes are executed.
         PB.registerVectorizerStartEPCallback(
-            [](FunctionPassManager &FPM, OptimizationLevel O) {
-              addPassesFromEnvVar(FPM, EnvVarPrefix + "VECTORIZERSTART_PASSES");
+            [phase](FunctionPassManager &FPM, OptimizationLevel O) {
+              addPassesFromEnvVar(FPM, EnvVarPrefix + "VECTORIZERSTART_PASSES",
+                                  phase);
             });
 
         // Add optimization once at the start of the pipeline. This does not
         // apply to 'backend' compiles (LTO and ThinLTO link-time pipelines).
-        PB.registerPipelineStartEPCallback([&](ModulePassManager &MPM
+        PB.registerPipelineStartEPCallback([phase](ModulePassManager &MPM
 #if LLVM_VERSION_MAJOR >= 12
-                                               ,
-                                               OptimizationLevel O
+                                                   ,
+                                                   OptimizationLevel O
+#endif
+                                               ) {
+          addPassesFromEnvVar(MPM, EnvVarPrefix + "PIPELINESTART_PASSES",
+                              phase);
+#if LLVM_VERSION_MAJOR < 13
+          addBudgetAnalysis(MPM);
 #endif
-                                           ) {
-          addPassesFromEnvVar(MPM, EnvVarPrefix + "PIPELINESTART_PASSES");
         });
 
 #if LLVM_VERSION_MAJOR >= 13
         // Add optimization right after passes that do basic simplification of
         // the input IR.
         PB.registerPipelineEarlySimplificationEPCallback(
-            [](ModulePassManager &MPM, OptimizationLevel O
+            [phase](ModulePassManager &MPM, OptimizationLevel O
+#if LLVM_VERSION_MAJOR >= 20
+                    ,
+                    ThinOrFullLTOPhase Phase
+#endif
+                    ) {
 #if LLVM_VERSION_MAJOR >= 20
-              ,
-              ThinOrFullLTOPhase
+              // Built before the function passes of the pipeline run
+              phase->known = true;
+              phase->preLink = Phase == ThinOrFullLTOPhase::FullLTOPreLink ||
+                               Phase == ThinOrFullLTOPhase::ThinLTOPreLink;
+              phase->postLink = Phase == ThinOrFullLTOPhase::FullLTOPostLink ||
+                                Phase == ThinOrFullLTOPhase::ThinLTOPostLink;
 #endif
-              ) {
               addPassesFromEnvVar(
-                  MPM, EnvVarPrefix + "PIPELINEEARLYSIMPLIFICATION_PASSES");
+                  MPM, EnvVarPrefix + "PIPELINEEARLYSIMPLIFICATION_PASSES",
+                  phase);
+              addBudgetAnalysis(MPM);
             });
 #endif
 
@@ -151,13 +359,20 @@ extern "C" PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK llvmGetPassPluginInfo() {
         // Add optimizations at the very end of the function optimization
         // pipeline.
         PB.registerOptimizerLastEPCallback(
-            [](ModulePassManager &MPM, OptimizationLevel O
+            [phase](ModulePassManager &MPM, OptimizationLevel O
+#if LLVM_VERSION_MAJOR >= 20
+                    ,
+                    ThinOrFullLTOPhase Phase
+#endif
+                    ) {
+              addPassesFromEnvVar(MPM, EnvVarPrefix + "OPTIMIZERLASTEP_PASSES",
+                                  phase);
 #if LLVM_VERSION_MAJOR >= 20
-               ,
-               ThinOrFullLTOPhase
+              // The ThinLTO backends are the link-time stage of ThinLTO
+              if (Phase == ThinOrFullLTOPhase::ThinLTOPostLink) {
+                addLinkTimePasses(MPM);
+              }
 #endif
-              ) {
-              addPassesFromEnvVar(MPM, EnvVarPrefix + "OPTIMIZERLASTEP_PASSES");
             });
 #else
         // Add optimizations at the very end of the function optimization
@@ -166,8 +381,18 @@ extern "C" PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK llvmGetPassPluginInfo() {
         // at O0. Extensions to the O0 pipeline should append their passes to
         // the end of the overall pipeline.
         PB.registerOptimizerLastEPCallback(
-            [](FunctionPassManager &FPM, OptimizationLevel O) {
-              addPassesFromEnvVar(FPM, EnvVarPrefix + "OPTIMIZERLASTEP_PASSES");
+            [phase](FunctionPassManager &FPM, OptimizationLevel O) {
+              addPassesFromEnvVar(FPM, EnvVarPrefix + "OPTIMIZERLASTEP_PASSES",
+                                  phase);
+            });
+#endif
+
+#if LLVM_VERSION_MAJOR >= 15
+        // Add optimizations at the end of the full LTO pipeline, where the
+        // linkonce_odr functions deferred at compile time are obfuscated.
+        PB.registerFullLinkTimeOptimizationLastEPCallback(
+            [](ModulePassManager &MPM, OptimizationLevel O) {
+              addLinkTimePasses(MPM);
             });
 #endif
       }};
@@ -0,0 +1,131 @@
+//===- CloneThroughput.cpp - Altered block cloning benchmark --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Times BogusControlFlow::createAlteredBasicBlock, which clones a block and
+// adds junk code to the clone, on single blocks of each of the -sizes.
+//
+// A block is a chain of integer and float binary operators, with an integer
+// and a float comparison every few instructions, all of it feeding the
+// return value. Each size is cloned -clones times and the best of -repeat
+// runs is kept. The value names are discarded unless -discard-names=false.
+// Output is one CSV line per size:
+// instructions,clones,instructions_after,milliseconds,instructions_per_second
+//
+//===----------------------------------------------------------------------===//
+
+#include "bogus/BogusControlFlow.h"
+#include "utils/CryptoUtils.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::list<unsigned> Sizes("sizes", cl::CommaSeparated,
+                                cl::desc("Instructions per block, "
+                                         "100,1000,10000,100000 by default"));
+
+static cl::opt<unsigned>
+    Clones("clones", cl::init(0),
+           cl::desc("Clones per size, 1000000 instructions by default"));
+
+static cl::opt<bool>
+    DiscardNames("discard-names", cl::init(true),
+                 cl::desc("Discard the value names, as clang does by default"));
+
+static cl::opt<unsigned> Repeat("repeat", cl::init(3),
+                                cl::desc("Runs per size, best time is kept"));
+
+static Function *buildFunction(Module &M, unsigned size) {
+  LLVMContext &ctx = M.getContext();
+  Type *i32 = Type::getInt32Ty(ctx);
+  Type *f64 = Type::getDoubleTy(ctx);
+
+  Function *F = Function::Create(FunctionType::get(i32, {i32, f64}, false),
+                                 GlobalValue::ExternalLinkage, "f", M);
+  IRBuilder<> builder(BasicBlock::Create(ctx, "entry", F));
+
+  Value *v = F->getArg(0);
+  Value *d = F->getArg(1);
+  for (unsigned i = 0; i + 1 < size;) {
+    static const Instruction::BinaryOps ops[] = {
+        Instruction::Add, Instruction::Xor, Instruction::Sub, Instruction::Mul};
+    v = builder.CreateBinOp(ops[i % 4], v, ConstantInt::get(i32, i + 1));
+    d = builder.CreateFAdd(d, ConstantFP::get(f64, i));
+    i += 2;
+    if (i % 16 == 0 && i + 4 < size) {
+      Value *c = builder.CreateICmpSLT(v, ConstantInt::get(i32, i));
+      Value *fc = builder.CreateFCmpOLT(d, ConstantFP::get(f64, i));
+      v = builder.CreateSelect(builder.CreateAnd(c, fc), v,
+                               ConstantInt::get(i32, 0));
+      i += 4;
+    }
+  }
+  builder.CreateRet(v);
+  return F;
+}
+
+static uint64_t countInstructions(const Function &F) {
+  uint64_t count = 0;
+  for (const BasicBlock &BB : F) {
+    count += BB.size();
+  }
+  return count;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "altered block cloning\n");
+
+  if (Sizes.empty()) {
+    for (unsigned size : {100, 1000, 10000, 100000}) {
+      Sizes.push_back(size);
+    }
+  }
+
+  llvm::cryptoutils->prng_seed("0xA04252B187478C00A40BC6D81D1A8A52");
+
+  outs() << "instructions,clones,instructions_after,milliseconds,"
+            "instructions_per_second\n";
+  for (unsigned size : Sizes) {
+    unsigned clones = Clones ? Clones : std::max(1u, 1000000 / size);
+    double best = 0;
+    uint64_t before = 0, after = 0;
+    for (unsigned r = 0; r < Repeat; ++r) {
+      LLVMContext ctx;
+      ctx.setDiscardValueNames(DiscardNames);
+      Module M("clone-throughput", ctx);
+      Function *F = buildFunction(M, size);
+      BasicBlock *BB = &F->getEntryBlock();
+      before = BB->size();
+      BogusControlFlow bcf;
+
+      TimeRecord start = TimeRecord::getCurrentTime(true);
+      for (unsigned c = 0; c < clones; ++c) {
+        bcf.createAlteredBasicBlock(BB, "alteredBB", F);
+      }
+      TimeRecord end = TimeRecord::getCurrentTime(false);
+
+      double ms = (end.getWallTime() - start.getWallTime()) * 1000;
+      if (r == 0 || ms < best) {
+        best = ms;
+      }
+      after = (countInstructions(*F) - before) / clones;
+    }
+
+    outs() << before << "," << clones << "," << after << ","
+           << format("%.3f", best) << ","
+           << format("%.0f", before * clones / (best / 1000)) << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,331 @@
+//===- CompileScaling.cpp - Compile-time scaling benchmark ----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Times the obfuscation passes on synthetic modules, one size parameter
+// (-vary) being multiplied by each of the -scales while the others keep their
+// value. A pass whose cost is linear in the input gives a straight line, the
+// quadratic behaviors (module rescans, switch lowering...) show up as curves.
+//
+// Each function of the synthetic module is a forward CFG of -blocks blocks.
+// Every block starts with a phi of the accumulators of its predecessors (the
+// last one with an unused copy, a regression input for the stack fixing), is
+// made of -instructions binary operators and ends with a switch
+// (-switch-density percent of the blocks) or a conditional branch to the next
+// blocks. The -strings global strings are passed to an external function from
+// the entry blocks.
+//
+// Each measurement runs in a child process so that its peak RSS is its own.
+// Output is one CSV line per pass and scale:
+// pass,functions,blocks,instructions,switch_density,strings,
+// instructions_before,instructions_after,milliseconds,peak_kb
+//
+//===----------------------------------------------------------------------===//
+
+#include "utils/CryptoUtils.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/PassBuilder.h"
+#if LLVM_VERSION_MAJOR >= 22
+#include "llvm/Plugins/PassPlugin.h"
+#else
+#include "llvm/Passes/PassPlugin.h"
+#endif
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo();
+
+static cl::list<std::string>
+    Passes("passes", cl::CommaSeparated,
+           cl::desc("Passes to time, all the obfuscation passes by default"));
+
+static cl::opt<unsigned> Functions("functions", cl::init(10),
+                                   cl::desc("Number of functions"));
+
+static cl::opt<unsigned> Blocks("blocks", cl::init(50),
+                                cl::desc("Number of blocks per function"));
+
+static cl::opt<unsigned>
+    Instructions("instructions", cl::init(10),
+                 cl::desc("Number of instructions per block"));
+
+static cl::opt<unsigned>
+    SwitchDensity("switch-density", cl::init(10),
+                  cl::desc("Percentage of blocks ending with a switch"));
+
+static cl::opt<unsigned> Strings("strings", cl::init(100),
+                                 cl::desc("Number of global strings"));
+
+static cl::opt<std::string>
+    Vary("vary", cl::init("blocks"),
+         cl::desc("Parameter multiplied by the scales: functions, blocks, "
+                  "instructions or strings"));
+
+static cl::list<unsigned> Scales("scales", cl::CommaSeparated,
+                                 cl::desc("Factors applied to -vary, "
+                                          "1,2,4,8,16 by default"));
+
+static cl::opt<unsigned> Repeat("repeat", cl::init(3),
+                                cl::desc("Runs per point, best time is kept"));
+
+namespace {
+struct Params {
+  unsigned functions;
+  unsigned blocks;
+  unsigned instructions;
+  unsigned strings;
+};
+} // namespace
+
+static void buildFunction(Module &M, unsigned index, const Params &params,
+                          ArrayRef<GlobalVariable *> strings) {
+  LLVMContext &ctx = M.getContext();
+  Type *i32 = Type::getInt32Ty(ctx);
+  Type *i8ptr = PointerType::getUnqual(Type::getInt8Ty(ctx));
+
+  Function *F = Function::Create(FunctionType::get(i32, {i32}, false),
+                                 GlobalValue::ExternalLinkage,
+                                 "f" + Twine(index), M);
+  FunctionCallee use = M.getOrInsertFunction(
+      "use", FunctionType::get(Type::getVoidTy(ctx), {i8ptr}, false));
+
+  unsigned n = params.blocks;
+  SmallVector<BasicBlock *, 64> blocks;
+  for (unsigned i = 0; i < n; ++i) {
+    blocks.push_back(BasicBlock::Create(ctx, "b" + Twine(i), F));
+  }
+
+  // Accumulators flowing into each block, with the block they come from
+  std::vector<SmallVector<std::pair<Value *, BasicBlock *>, 4>> incoming(n);
+  incoming[0].push_back({F->getArg(0), nullptr});
+
+  IRBuilder<> builder(ctx);
+  for (unsigned i = 0; i < n; ++i) {
+    BasicBlock *BB = blocks[i];
+    builder.SetInsertPoint(BB);
+
+    Value *v = incoming[i][0].first;
+    if (incoming[i].size() > 1) {
+      PHINode *phi = builder.CreatePHI(i32, incoming[i].size());
+      for (auto &in : incoming[i]) {
+        phi->addIncoming(in.first, in.second);
+      }
+      v = phi;
+
+      // And a phi without uses, which the stack fixing has to drop
+      if (i == n - 1) {
+        PHINode *dead = builder.CreatePHI(i32, incoming[i].size());
+        for (auto &in : incoming[i]) {
+          dead->addIncoming(in.first, in.second);
+        }
+      }
+    }
+
+    if (i == 0) {
+      for (unsigned s = index; s < strings.size(); s += params.functions) {
+        builder.CreateCall(use, {builder.CreatePointerCast(strings[s], i8ptr)});
+      }
+    }
+
+    for (unsigned j = 0; j < params.instructions; ++j) {
+      static const Instruction::BinaryOps ops[] = {
+          Instruction::Add, Instruction::Xor, Instruction::Sub,
+          Instruction::Or, Instruction::And, Instruction::Mul};
+      v = builder.CreateBinOp(ops[(i + j) % 6], v,
+                              ConstantInt::get(i32, i * 31 + j + 1));
+    }
+
+    if (i == n - 1) {
+      builder.CreateRet(v);
+      continue;
+    }
+
+    // Forward edges only, to the next three blocks at most
+    SmallVector<unsigned, 3> targets;
+    for (unsigned t = i + 1; t <= i + 3 && t < n; ++t) {
+      targets.push_back(t);
+    }
+
+    Value *cond = builder.CreateAnd(v, ConstantInt::get(i32, 3));
+    if (targets.size() > 2 && (i * 37 + index) % 100 < SwitchDensity) {
+      SwitchInst *SI = builder.CreateSwitch(cond, blocks[targets[0]]);
+      for (unsigned t = 1; t < targets.size(); ++t) {
+        SI->addCase(ConstantInt::get(cast<IntegerType>(i32), t),
+                    blocks[targets[t]]);
+      }
+    } else if (targets.size() > 1) {
+      builder.CreateCondBr(builder.CreateICmpEQ(cond, ConstantInt::get(i32, 0)),
+                           blocks[targets[0]], blocks[targets[1]]);
+      targets.resize(2);
+    } else {
+      builder.CreateBr(blocks[targets[0]]);
+    }
+
+    for (unsigned t : targets) {
+      incoming[t].push_back({v, BB});
+    }
+  }
+}
+
+static std::unique_ptr<Module> buildModule(LLVMContext &ctx,
+                                           const Params &params) {
+  std::unique_ptr<Module> M = std::make_unique<Module>("compile-scaling", ctx);
+
+  SmallVector<GlobalVariable *, 0> strings;
+  for (unsigned s = 0; s < params.strings; ++s) {
+    Constant *init = ConstantDataArray::getString(
+        ctx, "synthetic string " + std::to_string(s));
+    strings.push_back(new GlobalVariable(*M, init->getType(), true,
+                                         GlobalValue::PrivateLinkage, init,
+                                         "str" + Twine(s)));
+  }
+
+  for (unsigned f = 0; f < params.functions; ++f) {
+    buildFunction(*M, f, params, strings);
+  }
+
+  return M;
+}
+
+static uint64_t countInstructions(const Module &M) {
+  uint64_t count = 0;
+  for (const Function &F : M) {
+    for (const BasicBlock &BB : F) {
+      count += BB.size();
+    }
+  }
+  return count;
+}
+
+// Runs in the child process, prints the end of the CSV line
+static int measure(StringRef pass, const Params &params) {
+  PassPluginLibraryInfo plugin = llvmGetPassPluginInfo();
+  std::string pipeline = pass == "string-encryption"
+                             ? pass.str()
+                             : ("function(" + pass + ")").str();
+
+  double best = 0;
+  uint64_t before = 0, after = 0;
+  for (unsigned r = 0; r < Repeat; ++r) {
+    LLVMContext ctx;
+    std::unique_ptr<Module> M = buildModule(ctx, params);
+    before = countInstructions(*M);
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB;
+
+    plugin.RegisterPassBuilderCallbacks(PB);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    if (Error err = PB.parsePassPipeline(MPM, pipeline)) {
+      errs() << toString(std::move(err)) << "\n";
+      return 1;
+    }
+
+    TimeRecord start = TimeRecord::getCurrentTime(true);
+    MPM.run(*M, MAM);
+    TimeRecord end = TimeRecord::getCurrentTime(false);
+
+    double ms = (end.getWallTime() - start.getWallTime()) * 1000;
+    if (r == 0 || ms < best) {
+      best = ms;
+    }
+    after = countInstructions(*M);
+  }
+
+  outs() << before << "," << after << "," << format("%.3f", best);
+  outs().flush();
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "obfuscation passes scaling\n");
+
+  if (Passes.empty()) {
+    for (const char *pass : {"flattening", "bogus", "substitution",
+                             "split-basic-blocks", "string-encryption"}) {
+      Passes.push_back(pass);
+    }
+  }
+  if (Scales.empty()) {
+    for (unsigned scale : {1, 2, 4, 8, 16}) {
+      Scales.push_back(scale);
+    }
+  }
+
+  Params base = {Functions, Blocks, Instructions, Strings};
+  unsigned Params::*varied = StringSwitch<unsigned Params::*>(Vary)
+                                 .Case("functions", &Params::functions)
+                                 .Case("blocks", &Params::blocks)
+                                 .Case("instructions", &Params::instructions)
+                                 .Case("strings", &Params::strings)
+                                 .Default(nullptr);
+  if (!varied) {
+    errs() << argv[0] << ": unknown parameter '" << Vary << "'\n";
+    return 1;
+  }
+  if (Functions == 0 || Blocks == 0) {
+    errs() << argv[0] << ": a module needs a function and a block\n";
+    return 1;
+  }
+
+  llvm::cryptoutils->prng_seed("0xA04252B187478C00A40BC6D81D1A8A52");
+
+  outs() << "pass,functions,blocks,instructions,switch_density,strings,"
+            "instructions_before,instructions_after,milliseconds,peak_kb\n";
+  for (const std::string &pass : Passes) {
+    for (unsigned scale : Scales) {
+      Params params = base;
+      params.*varied *= scale;
+
+      outs() << pass << "," << params.functions << "," << params.blocks << ","
+             << params.instructions << "," << SwitchDensity << ","
+             << params.strings << ",";
+      outs().flush();
+
+      pid_t pid = fork();
+      if (pid == 0) {
+        _exit(measure(pass, params));
+      }
+
+      int status = 0;
+      struct rusage usage;
+      if (pid < 0 || wait4(pid, &status, 0, &usage) < 0 ||
+          !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        outs() << "failed\n";
+        continue;
+      }
+      outs() << "," << usage.ru_maxrss << "\n";
+    }
+  }
+
+  return 0;
+}
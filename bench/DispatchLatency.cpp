@@ -0,0 +1,222 @@
+//===- DispatchLatency.cpp - Flattening dispatcher benchmark --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Times the dispatcher of the flattening pass on state machines of each of
+// the -states, compiled with the JIT at O2.
+//
+// The function of a state machine has one block per state, each updating an
+// accumulator and going on to the next state or to a distant one depending on
+// it, until -steps transitions are made. It is run without flattening, with
+// the default sparse states and with -fla_dense, the dispatch cost being the
+// difference with the first one. Output is one CSV line per size and mode:
+// states,mode,blocks,nanoseconds_per_transition
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/PassBuilder.h"
+#if LLVM_VERSION_MAJOR >= 22
+#include "llvm/Plugins/PassPlugin.h"
+#else
+#include "llvm/Passes/PassPlugin.h"
+#endif
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Last, its macros clash with the ORC headers
+#include "utils/CryptoUtils.h"
+
+using namespace llvm;
+
+extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo();
+
+static cl::list<unsigned> States("states", cl::CommaSeparated,
+                                 cl::desc("State machine sizes, "
+                                          "100,1000,10000 by default"));
+
+static cl::opt<unsigned> Steps("steps", cl::init(20000000),
+                               cl::desc("Transitions per run"));
+
+static cl::opt<unsigned> Repeat("repeat", cl::init(3),
+                                cl::desc("Runs per point, best time is kept"));
+
+// int run(int steps), returning the accumulator. The state is only kept in
+// volatile memory, or the values live across the state blocks would become as
+// many phis in the dispatcher, which the O2 pipeline and the backend are
+// quadratic in.
+static void buildStateMachine(Module &M, unsigned states) {
+  LLVMContext &ctx = M.getContext();
+  Type *i32 = Type::getInt32Ty(ctx);
+
+  Function *F = Function::Create(FunctionType::get(i32, {i32}, false),
+                                 GlobalValue::ExternalLinkage, "run", M);
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", F);
+  SmallVector<BasicBlock *, 0> blocks;
+  for (unsigned i = 0; i < states; ++i) {
+    blocks.push_back(BasicBlock::Create(ctx, "state" + Twine(i), F));
+  }
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", F);
+
+  IRBuilder<> builder(entry);
+  AllocaInst *acc = builder.CreateAlloca(i32);
+  AllocaInst *left = builder.CreateAlloca(i32);
+  builder.CreateStore(builder.getInt32(0), acc, true);
+  builder.CreateStore(F->getArg(0), left, true);
+  builder.CreateBr(blocks[0]);
+
+  for (unsigned i = 0; i < states; ++i) {
+    builder.SetInsertPoint(blocks[i]);
+    Value *a = builder.CreateLoad(i32, acc, true);
+    a = builder.CreateAdd(builder.CreateMul(a, builder.getInt32(31)),
+                          builder.getInt32(i));
+    builder.CreateStore(a, acc, true);
+    Value *n = builder.CreateSub(builder.CreateLoad(i32, left, true),
+                                 builder.getInt32(1));
+    builder.CreateStore(n, left, true);
+
+    // Next state, or a distant one, or the end
+    BasicBlock *next = BasicBlock::Create(ctx, "next" + Twine(i), F, exit);
+    builder.CreateCondBr(builder.CreateICmpEQ(n, builder.getInt32(0)), exit,
+                         next);
+    builder.SetInsertPoint(next);
+    a = builder.CreateLoad(i32, acc, true);
+    Value *odd = builder.CreateTrunc(builder.CreateLShr(a, 7),
+                                     builder.getInt1Ty());
+    builder.CreateCondBr(odd, blocks[(i + 1) % states],
+                         blocks[(i * 7 + 3) % states]);
+  }
+
+  builder.SetInsertPoint(exit);
+  builder.CreateRet(builder.CreateLoad(i32, acc, true));
+}
+
+// Runs in the JIT, -1 on error
+static double measure(unsigned states, StringRef mode, uint64_t &blocks,
+                      uint32_t &result) {
+  auto ctx = std::make_unique<LLVMContext>();
+  auto M = std::make_unique<Module>("dispatch-latency", *ctx);
+  buildStateMachine(*M, states);
+
+  // As if given on the command line, which overrides LLVM_OBF_FLA_DENSE
+  cl::Option *dense = cl::getRegisteredOptions()["fla_dense"];
+  dense->reset();
+  dense->addOccurrence(0, "fla_dense", mode == "dense" ? "true" : "false");
+
+  {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB;
+
+    llvmGetPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    std::string pipeline = mode == "none"
+                               ? "default<O2>"
+                               : "function(flattening),default<O2>";
+    ModulePassManager MPM;
+    if (Error err = PB.parsePassPipeline(MPM, pipeline)) {
+      errs() << toString(std::move(err)) << "\n";
+      return -1;
+    }
+    MPM.run(*M, MAM);
+  }
+
+  blocks = 0;
+  for (Function &F : *M) {
+    blocks += F.size();
+  }
+
+  auto J = orc::LLJITBuilder().create();
+  if (!J) {
+    errs() << toString(J.takeError()) << "\n";
+    return -1;
+  }
+  if (Error err = (*J)->addIRModule(
+          orc::ThreadSafeModule(std::move(M), std::move(ctx)))) {
+    errs() << toString(std::move(err)) << "\n";
+    return -1;
+  }
+  auto symbol = (*J)->lookup("run");
+  if (!symbol) {
+    errs() << toString(symbol.takeError()) << "\n";
+    return -1;
+  }
+#if LLVM_VERSION_MAJOR >= 15
+  auto run = symbol->toPtr<uint32_t (*)(uint32_t)>();
+#else
+  auto run = (uint32_t(*)(uint32_t))symbol->getAddress();
+#endif
+
+  double best = 0;
+  for (unsigned r = 0; r < Repeat; ++r) {
+    TimeRecord start = TimeRecord::getCurrentTime(true);
+    result = run(Steps);
+    TimeRecord end = TimeRecord::getCurrentTime(false);
+
+    double seconds = end.getWallTime() - start.getWallTime();
+    if (r == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+
+  // A step is a state block and its next block
+  return best * 1e9 / (2.0 * Steps);
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "flattening dispatch latency\n");
+
+  if (States.empty()) {
+    for (unsigned size : {100, 1000, 10000}) {
+      States.push_back(size);
+    }
+  }
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  llvm::cryptoutils->prng_seed("0xA04252B187478C00A40BC6D81D1A8A52");
+
+  outs() << "states,mode,blocks,nanoseconds_per_transition\n";
+  for (unsigned states : States) {
+    uint32_t expected = 0;
+    for (StringRef mode : {"none", "sparse", "dense"}) {
+      uint64_t blocks = 0;
+      uint32_t result = 0;
+      double ns = measure(states, mode, blocks, result);
+      if (ns < 0) {
+        return 1;
+      }
+      if (mode == "none") {
+        expected = result;
+      } else if (result != expected) {
+        errs() << argv[0] << ": " << mode << " result differs\n";
+        return 1;
+      }
+
+      outs() << states << "," << mode << "," << blocks << ","
+             << format("%.3f", ns) << "\n";
+      outs().flush();
+    }
+  }
+
+  return 0;
+}
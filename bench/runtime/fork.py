@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+#
+# Memory cost of the string encryption in forked processes.
+#
+# Builds the prefork kernel of kernels/ with clang and the plugin without any
+# pass, with the string encryption decoding the strings in place and with the
+# strings decoded into the arena (LLVM_OBF_STRING_ARENA), then runs each
+# binary. The kernel prints the private dirty memory and the minor page
+# faults of the parent after the module constructors, and of each worker it
+# forks after its requests, which have to print the baseline checksum.
+#
+# The results are written as JSON, with the deltas to the baseline:
+#
+# {"results": [{"mode": "arena", "parent_private_dirty_kb": ...,
+#               "parent_minor_faults": ..., "worker_private_dirty_kb": ...,
+#               "worker_minor_faults": ..., "total_private_dirty_kb": ...,
+#               "delta": {"total_private_dirty_kb": ..., ...}}]}
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+from run import SEED, build
+
+MODES = [("baseline", None, {}),
+         ("in-place", ["string-encryption"], {}),
+         ("arena", ["string-encryption"], {"LLVM_OBF_STRING_ARENA": "y"})]
+
+METRICS = ["parent_private_dirty_kb", "parent_minor_faults",
+           "worker_private_dirty_kb", "worker_minor_faults",
+           "total_private_dirty_kb"]
+
+
+def measure(args, binary):
+    """Parent figures, the worker ones averaged, None on failure"""
+    result = subprocess.run([binary, str(args.workers), str(args.requests)],
+                            stdout=subprocess.PIPE, universal_newlines=True)
+    if result.returncode != 0:
+        return None
+    parent = None
+    workers = []
+    for line in result.stdout.splitlines():
+        fields = line.split()
+        if fields[0] == "parent":
+            parent = [int(field) for field in fields[1:3]]
+        elif fields[0] == "worker":
+            workers.append(fields[1:4])
+    if parent is None or len(workers) != args.workers:
+        return None
+
+    dirty = sum(int(worker[0]) for worker in workers)
+    faults = sum(int(worker[1]) for worker in workers)
+    return {"parent_private_dirty_kb": parent[0],
+            "parent_minor_faults": parent[1],
+            "worker_private_dirty_kb": dirty / len(workers),
+            "worker_minor_faults": faults / len(workers),
+            "total_private_dirty_kb": parent[0] + dirty,
+            "checksum": workers[0][2]}
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Memory cost of the string encryption in forked processes")
+    parser.add_argument("--clang", default="clang")
+    parser.add_argument("--plugin", required=True,
+                        help="path to libLLVMObfuscator.so")
+    parser.add_argument("--cflags", default="",
+                        help="additional clang flags")
+    parser.add_argument("--workers", type=int, default=8,
+                        help="processes forked by the kernel")
+    parser.add_argument("--requests", type=int, default=10,
+                        help="lookups of the whole table per worker")
+    parser.add_argument("--output", default="fork.json")
+    args = parser.parse_args()
+
+    args.cflags = args.cflags.split()
+    args.plugin = os.path.abspath(args.plugin)
+
+    results = []
+    with tempfile.TemporaryDirectory() as directory:
+        binary = os.path.join(directory, "prefork")
+        for mode, passes, options in MODES:
+            result = {"mode": mode}
+            measurement = None
+            if build(args, "prefork", binary, passes, "OPTIMIZERLASTEP",
+                     options) is not None:
+                # The pages of a binary not written back yet count as dirty
+                os.sync()
+                measurement = measure(args, binary)
+            if measurement is None:
+                print("%-8s failed" % mode)
+                result["failed"] = True
+                results.append(result)
+                continue
+
+            result.update(measurement)
+            base = results[0] if results else None
+            if base is not None and not base.get("failed"):
+                result["checksum_ok"] = (measurement["checksum"] ==
+                                         base["checksum"])
+                result["delta"] = {metric: measurement[metric] - base[metric]
+                                   for metric in METRICS}
+            results.append(result)
+            print("%-8s %6d kB %6d faults parent  %8.1f kB %8.1f faults "
+                  "worker  %7d kB total%s" %
+                  (mode, result["parent_private_dirty_kb"],
+                   result["parent_minor_faults"],
+                   result["worker_private_dirty_kb"],
+                   result["worker_minor_faults"],
+                   result["total_private_dirty_kb"],
+                   "" if result.get("checksum_ok", True)
+                   else "  WRONG CHECKSUM"))
+
+    with open(args.output, "w") as output:
+        json.dump({"clang": args.clang, "seed": SEED, "workers": args.workers,
+                   "results": results}, output, indent=2)
+        output.write("\n")
+
+    if any(r.get("failed") or not r.get("checksum_ok", True)
+           for r in results):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
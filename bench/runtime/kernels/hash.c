@@ -0,0 +1,55 @@
+// Hashing: FNV-1a and a murmur-like mixer over a pseudo-random buffer.
+// Tight loops of arithmetic, where substitution shows up.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIZE (64 * 1024)
+
+static uint8_t buffer[SIZE];
+
+static uint32_t fnv1a(const uint8_t *data, size_t size) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    h ^= data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint64_t mix(const uint8_t *data, size_t size, uint64_t seed) {
+  uint64_t h = seed ^ (size * 0xc6a4a7935bd1e995ull);
+  for (size_t i = 0; i + 8 <= size; i += 8) {
+    uint64_t k = 0;
+    for (int j = 0; j < 8; j++) {
+      k |= (uint64_t)data[i + j] << (8 * j);
+    }
+    k *= 0xc6a4a7935bd1e995ull;
+    k ^= k >> 47;
+    k *= 0xc6a4a7935bd1e995ull;
+    h ^= k;
+    h *= 0xc6a4a7935bd1e995ull;
+  }
+  h ^= h >> 47;
+  return h;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1500;
+
+  uint32_t state = 1;
+  for (size_t i = 0; i < SIZE; i++) {
+    state = state * 1103515245u + 12345u;
+    buffer[i] = state >> 16;
+  }
+
+  uint64_t checksum = 0;
+  for (long i = 0; i < iterations; i++) {
+    checksum += fnv1a(buffer, SIZE);
+    checksum ^= mix(buffer, SIZE, checksum);
+  }
+
+  printf("%llu\n", (unsigned long long)checksum);
+  return 0;
+}
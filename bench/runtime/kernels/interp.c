@@ -0,0 +1,85 @@
+// Interpreter: a stack bytecode machine dispatching on a switch.
+// The dispatch loop is what flattening and bogus control flow hurt most.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+enum {
+  PUSH, LOAD, STORE, ADD, SUB, MUL, XOR, LT, JZ, JMP, HALT
+};
+
+// i = 0; acc = 0; while (i < n) { acc = acc * 33 ^ i; i = i + 1; } return acc
+static const int32_t program[] = {
+    PUSH, 0,  STORE, 0,             // i = 0
+    PUSH, 0,  STORE, 1,             // acc = 0
+    LOAD, 0,  LOAD,  2,  LT,        // 8: i < n
+    JZ,   34,                       // 13
+    LOAD, 1,  PUSH,  33, MUL,       // 15: acc * 33
+    LOAD, 0,  XOR,   STORE, 1,      // 20: ^ i
+    LOAD, 0,  PUSH,  1,  ADD,       // 25: i + 1
+    STORE, 0, JMP,   8,             // 30
+    LOAD, 1,  HALT                  // 34
+};
+
+static int64_t run(const int32_t *code, int64_t n) {
+  int64_t stack[16], vars[3] = {0, 0, n};
+  int sp = 0;
+  int pc = 0;
+
+  for (;;) {
+    switch (code[pc++]) {
+    case PUSH:
+      stack[sp++] = code[pc++];
+      break;
+    case LOAD:
+      stack[sp++] = vars[code[pc++]];
+      break;
+    case STORE:
+      vars[code[pc++]] = stack[--sp];
+      break;
+    case ADD:
+      sp--;
+      stack[sp - 1] += stack[sp];
+      break;
+    case SUB:
+      sp--;
+      stack[sp - 1] -= stack[sp];
+      break;
+    case MUL:
+      sp--;
+      stack[sp - 1] *= stack[sp];
+      break;
+    case XOR:
+      sp--;
+      stack[sp - 1] ^= stack[sp];
+      break;
+    case LT:
+      sp--;
+      stack[sp - 1] = stack[sp - 1] < stack[sp];
+      break;
+    case JZ:
+      pc = stack[--sp] ? pc + 1 : code[pc];
+      break;
+    case JMP:
+      pc = code[pc];
+      break;
+    case HALT:
+      return stack[sp - 1];
+    default:
+      abort();
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 40;
+
+  uint64_t checksum = 0;
+  for (long i = 0; i < iterations; i++) {
+    checksum += run(program, 100000 + i);
+  }
+
+  printf("%llu\n", (unsigned long long)checksum);
+  return 0;
+}
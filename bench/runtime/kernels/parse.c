@@ -0,0 +1,97 @@
+// Parsing: a hand-written lexer over generated key=value records.
+// Byte-by-byte state machine, branchy code where flattening shows up.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RECORDS 4096
+
+static char text[RECORDS * 48];
+
+static size_t generate(void) {
+  size_t n = 0;
+  uint32_t state = 7;
+  for (int r = 0; r < RECORDS; r++) {
+    state = state * 1103515245u + 12345u;
+    n += sprintf(text + n, "key%u = %d, name=\"v%u\" ; # c\n",
+                 (state >> 8) % 1000, (int)(state >> 4) % 100000 - 50000,
+                 state >> 20);
+  }
+  return n;
+}
+
+enum { START, KEY, VALUE, NUMBER, STRING, COMMENT };
+
+static uint64_t parse(const char *p, const char *end) {
+  uint64_t sum = 0;
+  int64_t number = 0;
+  int negative = 0;
+  int state = START;
+
+  for (; p < end; p++) {
+    char c = *p;
+    switch (state) {
+    case START:
+      if (c == '#') {
+        state = COMMENT;
+      } else if ((c >= 'a' && c <= 'z') || c == '_') {
+        sum = sum * 31 + c;
+        state = KEY;
+      }
+      break;
+    case KEY:
+      if (c == '=') {
+        state = VALUE;
+      } else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
+        sum = sum * 31 + c;
+      }
+      break;
+    case VALUE:
+      if (c == '-') {
+        negative = 1;
+      } else if (c >= '0' && c <= '9') {
+        number = c - '0';
+        state = NUMBER;
+      } else if (c == '"') {
+        state = STRING;
+      }
+      break;
+    case NUMBER:
+      if (c >= '0' && c <= '9') {
+        number = number * 10 + (c - '0');
+      } else {
+        sum += negative ? -number : number;
+        negative = 0;
+        state = c == '\n' ? START : (c == '#' ? COMMENT : START);
+      }
+      break;
+    case STRING:
+      if (c == '"') {
+        state = START;
+      } else {
+        sum ^= (uint64_t)c << (sum & 31);
+      }
+      break;
+    case COMMENT:
+      if (c == '\n') {
+        state = START;
+      }
+      break;
+    }
+  }
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 500;
+  size_t size = generate();
+
+  uint64_t checksum = 0;
+  for (long i = 0; i < iterations; i++) {
+    checksum += parse(text, text + size);
+  }
+
+  printf("%llu\n", (unsigned long long)checksum);
+  return 0;
+}
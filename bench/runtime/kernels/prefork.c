@@ -0,0 +1,101 @@
+// Pre-forking server: a table of 4096 literals decoded before main, then
+// workers forked from the parent, each of them looking all the messages up
+// and updating its own counters. The parent and each worker print the private
+// dirty memory and the minor page faults of the process, on which fork.py
+// compares the string encryption modes:
+// parent <private_dirty_kb> <minor_faults>
+// worker <private_dirty_kb> <minor_faults> <checksum>
+// The faults of a worker are the ones since the fork.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define S1(n) "message " #n " served by every worker of the pre-forking server"
+#define S4(n) S1(n##0), S1(n##1), S1(n##2), S1(n##3)
+#define S16(n) S4(n##0), S4(n##1), S4(n##2), S4(n##3)
+#define S64(n) S16(n##0), S16(n##1), S16(n##2), S16(n##3)
+#define S256(n) S64(n##0), S64(n##1), S64(n##2), S64(n##3)
+#define S1024(n) S256(n##0), S256(n##1), S256(n##2), S256(n##3)
+
+static const char *const messages[] = {S1024(1), S1024(2), S1024(3),
+                                       S1024(4)};
+
+#define COUNT (sizeof(messages) / sizeof(messages[0]))
+
+static unsigned hits[COUNT];
+
+static uint32_t hash(const char *s) {
+  uint32_t h = 5381;
+  while (*s) {
+    h = h * 33 + (unsigned char)*s++;
+  }
+  return h;
+}
+
+// Private_Dirty of /proc/self/smaps_rollup, -1 if unavailable
+static long private_dirty_kb(void) {
+  FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+  if (smaps == NULL) {
+    return -1;
+  }
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof(line), smaps) != NULL) {
+    if (sscanf(line, "Private_Dirty: %ld kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(smaps);
+  return kb;
+}
+
+static long minor_faults(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+static void serve(long requests) {
+  uint64_t checksum = 0;
+  for (long i = 0; i < requests; i++) {
+    for (size_t m = 0; m < COUNT; m++) {
+      const char *message = messages[(m * 7 + i) % COUNT];
+      checksum += hash(message) ^ strlen(message);
+      hits[(m * 7 + i) % COUNT]++;
+    }
+  }
+  printf("worker %ld %ld %llu\n", private_dirty_kb(), minor_faults(),
+         (unsigned long long)checksum);
+}
+
+int main(int argc, char **argv) {
+  int workers = argc > 1 ? atoi(argv[1]) : 8;
+  long requests = argc > 2 ? atol(argv[2]) : 10;
+
+  printf("parent %ld %ld\n", private_dirty_kb(), minor_faults());
+  fflush(stdout);
+
+  for (int w = 0; w < workers; w++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      serve(requests);
+      return 0;
+    }
+    // One at a time, the lines are not interleaved
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
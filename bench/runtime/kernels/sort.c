@@ -0,0 +1,72 @@
+// Sorting: quicksort with an insertion sort for the small partitions.
+// Recursion and data-dependent branches.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIZE (100 * 1000)
+
+static int32_t values[SIZE];
+
+static void insertion(int32_t *a, long n) {
+  for (long i = 1; i < n; i++) {
+    int32_t v = a[i];
+    long j = i - 1;
+    while (j >= 0 && a[j] > v) {
+      a[j + 1] = a[j];
+      j--;
+    }
+    a[j + 1] = v;
+  }
+}
+
+static void quicksort(int32_t *a, long n) {
+  while (n > 16) {
+    int32_t pivot = a[n / 2];
+    long i = 0, j = n - 1;
+    while (i <= j) {
+      while (a[i] < pivot) {
+        i++;
+      }
+      while (a[j] > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        int32_t t = a[i];
+        a[i++] = a[j];
+        a[j--] = t;
+      }
+    }
+    // Recurse on the small side, loop on the large one
+    if (j + 1 < n - i) {
+      quicksort(a, j + 1);
+      a += i;
+      n -= i;
+    } else {
+      quicksort(a + i, n - i);
+      n = j + 1;
+    }
+  }
+  insertion(a, n);
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 30;
+
+  uint64_t checksum = 0;
+  uint32_t state = 3;
+  for (long i = 0; i < iterations; i++) {
+    for (long k = 0; k < SIZE; k++) {
+      state = state * 1103515245u + 12345u;
+      values[k] = (int32_t)state;
+    }
+    quicksort(values, SIZE);
+    for (long k = 0; k < SIZE; k += 1000) {
+      checksum = checksum * 31 + (uint32_t)values[k];
+    }
+  }
+
+  printf("%llu\n", (unsigned long long)checksum);
+  return 0;
+}
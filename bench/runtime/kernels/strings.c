@@ -0,0 +1,43 @@
+// String-heavy startup: a table of 1024 literals looked up by hash. The
+// string encryption decodes them before main, so running it with 0 iterations
+// measures the decoding cost.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define S1(n) "message " #n " of the string-heavy startup benchmark"
+#define S4(n) S1(n##0), S1(n##1), S1(n##2), S1(n##3)
+#define S16(n) S4(n##0), S4(n##1), S4(n##2), S4(n##3)
+#define S64(n) S16(n##0), S16(n##1), S16(n##2), S16(n##3)
+#define S256(n) S64(n##0), S64(n##1), S64(n##2), S64(n##3)
+
+static const char *const messages[] = {S256(1), S256(2), S256(3), S256(4)};
+
+#define COUNT (sizeof(messages) / sizeof(messages[0]))
+
+static uint32_t hash(const char *s) {
+  uint32_t h = 5381;
+  while (*s) {
+    h = h * 33 + (unsigned char)*s++;
+  }
+  return h;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000;
+
+  uint64_t checksum = 0;
+  char line[128];
+  for (long i = 0; i < iterations; i++) {
+    for (size_t m = 0; m < COUNT; m++) {
+      const char *message = messages[(m * 7 + i) % COUNT];
+      snprintf(line, sizeof(line), "%s: %ld", message, i);
+      checksum += hash(line) ^ strlen(message);
+    }
+  }
+
+  printf("%llu\n", (unsigned long long)checksum);
+  return 0;
+}
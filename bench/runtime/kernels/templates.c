@@ -0,0 +1,45 @@
+// Startup with a large table of templates: 4096 markup fragments sharing most
+// of their text, as embedded templates or localization catalogs do. The string
+// encryption decodes them before main, which the first argument, the
+// CLOCK_MONOTONIC time in nanoseconds before the process was started, measures
+// along with the loading of the binary. Prints the time to main in
+// nanoseconds and a checksum of the table:
+// <time_to_main_ns> <checksum>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define T1(n)                                                                  \
+  "<tr class=\"row\"><td class=\"name\">{{item." #n ".name}}</td>"             \
+  "<td class=\"value\">{{item." #n ".value}}</td><td class=\"actions\">"       \
+  "<a href=\"/items/" #n "/edit\">Edit</a> <a href=\"/items/" #n               \
+  "/delete\">Delete</a></td></tr>"
+#define T4(n) T1(n##0), T1(n##1), T1(n##2), T1(n##3)
+#define T16(n) T4(n##0), T4(n##1), T4(n##2), T4(n##3)
+#define T64(n) T16(n##0), T16(n##1), T16(n##2), T16(n##3)
+#define T256(n) T64(n##0), T64(n##1), T64(n##2), T64(n##3)
+#define T1024(n) T256(n##0), T256(n##1), T256(n##2), T256(n##3)
+
+static const char *const templates[] = {T1024(1), T1024(2), T1024(3),
+                                        T1024(4)};
+
+#define COUNT (sizeof(templates) / sizeof(templates[0]))
+
+int main(int argc, char **argv) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long long start = argc > 1 ? atoll(argv[1]) : 0;
+  long long elapsed = (long long)now.tv_sec * 1000000000 + now.tv_nsec - start;
+
+  uint64_t checksum = 0;
+  for (size_t t = 0; t < COUNT; t++) {
+    for (const char *c = templates[t]; *c; c++) {
+      checksum = checksum * 31 + (unsigned char)*c;
+    }
+  }
+
+  printf("%lld %llu\n", elapsed, (unsigned long long)checksum);
+  return 0;
+}
@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+#
+# Runtime overhead of the obfuscation passes.
+#
+# Builds the kernels of kernels/ with clang and the plugin, once without any
+# pass for the baseline and once per configuration (passes x insertion point),
+# then runs them. Each kernel takes its iteration count as first argument and
+# prints a checksum, which has to match the baseline one. The startup time is
+# the time of a run with 0 iterations, where only the module constructors
+# (string decoding) and the setup of the kernel remain.
+#
+# The results are written as JSON, relative to the baseline:
+#
+# {"baseline": {"hash": {"seconds": ..., "startup_seconds": ...,
+#                        "text_size": ...}},
+#  "results": [{"kernel": "hash", "passes": ["flattening"],
+#               "point": "SCALAROPTIMIZERLATE", "slowdown": 1.8,
+#               "size_ratio": 1.4, "startup_ratio": 1.0, ...}]}
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+KERNELS = ["hash", "parse", "sort", "interp", "strings"]
+
+FUNCTION_POINTS = ["PEEPHOLE", "SCALAROPTIMIZERLATE", "VECTORIZERSTART"]
+
+# Function passes at the function insertion points, the string encryption at
+# the last module one
+CONFIGURATIONS = [(["flattening"], FUNCTION_POINTS),
+                  (["bogus"], FUNCTION_POINTS),
+                  (["substitution"], FUNCTION_POINTS),
+                  (["split-basic-blocks"], FUNCTION_POINTS),
+                  (["split-basic-blocks", "flattening", "bogus",
+                    "substitution"], FUNCTION_POINTS),
+                  (["string-encryption"], ["OPTIMIZERLASTEP"])]
+
+SEED = "0xA04252B187478C00A40BC6D81D1A8A52"
+
+
+def clean_env():
+    env = dict(os.environ)
+    for name in list(env):
+        if name.startswith("LLVM_OBF_"):
+            del env[name]
+    env["LLVM_OBF_SEED"] = SEED
+    return env
+
+
+def build(args, kernel, output, passes=None, point=None, options=None):
+    env = clean_env()
+    if passes:
+        env["LLVM_OBF_%s_PASSES" % point] = ",".join(passes)
+    env.update(options or {})
+
+    command = [args.clang, "-O2", "-fpass-plugin=" + args.plugin]
+    command += args.cflags
+    command += [os.path.join(HERE, "kernels", kernel + ".c"), "-o", output]
+    start = time.perf_counter()
+    result = subprocess.run(command, env=env, stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT, universal_newlines=True)
+    if result.returncode != 0:
+        sys.stderr.write(result.stdout)
+        return None
+    return time.perf_counter() - start
+
+
+def run(binary, iterations, repeat):
+    """Best wall time of repeat runs and the checksum printed"""
+    best = None
+    checksum = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        result = subprocess.run([binary] + iterations,
+                                stdout=subprocess.PIPE,
+                                universal_newlines=True)
+        seconds = time.perf_counter() - start
+        if result.returncode != 0:
+            return None, None
+        checksum = result.stdout.strip()
+        best = seconds if best is None else min(best, seconds)
+    return best, checksum
+
+
+def text_size(args, binary):
+    """Size of the code, as the text column of size (Berkeley format)"""
+    result = subprocess.run([args.size, binary], stdout=subprocess.PIPE,
+                            universal_newlines=True, check=True)
+    return int(result.stdout.splitlines()[1].split()[0])
+
+
+def measure(args, binary):
+    iterations = [str(args.iterations)] if args.iterations else []
+    seconds, checksum = run(binary, iterations, args.repeat)
+    if seconds is None:
+        return None
+    startup, _ = run(binary, ["0"], args.startup_repeat)
+    return {"seconds": seconds, "startup_seconds": startup,
+            "text_size": text_size(args, binary), "checksum": checksum}
+
+
+def ratio(value, base):
+    return value / base if base else None
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Runtime overhead of the obfuscation passes")
+    parser.add_argument("--clang", default="clang")
+    parser.add_argument("--plugin", required=True,
+                        help="path to libLLVMObfuscator.so")
+    parser.add_argument("--size", help="size tool, llvm-size next to clang "
+                        "or size by default")
+    parser.add_argument("--cflags", default="",
+                        help="additional clang flags")
+    parser.add_argument("--kernels", default=",".join(KERNELS),
+                        help="comma separated, all of them by default")
+    parser.add_argument("--passes",
+                        help="only the configurations with one of these "
+                        "comma separated passes")
+    parser.add_argument("--points",
+                        help="only these comma separated insertion points")
+    parser.add_argument("--iterations", type=int,
+                        help="kernel iterations, the kernel default otherwise")
+    parser.add_argument("--repeat", type=int, default=5,
+                        help="runs per binary, best time is kept")
+    parser.add_argument("--startup-repeat", type=int, default=20,
+                        help="runs with 0 iterations per binary")
+    parser.add_argument("--output", default="runtime.json")
+    args = parser.parse_args()
+
+    args.cflags = args.cflags.split()
+    args.plugin = os.path.abspath(args.plugin)
+    if not args.size:
+        llvm_size = os.path.join(
+            os.path.dirname(shutil.which(args.clang) or ""), "llvm-size")
+        args.size = llvm_size if os.path.exists(llvm_size) else "size"
+
+    kernels = args.kernels.split(",")
+    configurations = []
+    for passes, points in CONFIGURATIONS:
+        if args.passes and not set(passes) & set(args.passes.split(",")):
+            continue
+        for point in points:
+            if args.points and point not in args.points.split(","):
+                continue
+            configurations.append((passes, point))
+
+    baseline = {}
+    results = []
+    with tempfile.TemporaryDirectory() as directory:
+        for kernel in kernels:
+            binary = os.path.join(directory, kernel)
+            if build(args, kernel, binary) is None:
+                sys.exit("%s: baseline build failed" % kernel)
+            baseline[kernel] = measure(args, binary)
+            if baseline[kernel] is None:
+                sys.exit("%s: baseline run failed" % kernel)
+
+            for passes, point in configurations:
+                name = "%s at %s" % (",".join(passes), point)
+                result = {"kernel": kernel, "passes": passes, "point": point}
+                build_seconds = build(args, kernel, binary, passes, point)
+                measurement = None
+                if build_seconds is not None:
+                    measurement = measure(args, binary)
+                if measurement is None:
+                    print("%-8s %-64s failed" % (kernel, name))
+                    result["failed"] = True
+                    results.append(result)
+                    continue
+
+                base = baseline[kernel]
+                result.update(measurement)
+                result["build_seconds"] = build_seconds
+                result["checksum_ok"] = (measurement["checksum"] ==
+                                         base["checksum"])
+                result["slowdown"] = ratio(measurement["seconds"],
+                                           base["seconds"])
+                result["size_ratio"] = ratio(measurement["text_size"],
+                                             base["text_size"])
+                result["startup_ratio"] = ratio(measurement["startup_seconds"],
+                                                base["startup_seconds"])
+                results.append(result)
+                print("%-8s %-64s x%.2f time  x%.2f size  x%.2f startup%s" %
+                      (kernel, name, result["slowdown"], result["size_ratio"],
+                       result["startup_ratio"],
+                       "" if result["checksum_ok"] else "  WRONG CHECKSUM"))
+
+    with open(args.output, "w") as output:
+        json.dump({"clang": args.clang, "seed": SEED, "baseline": baseline,
+                   "results": results}, output, indent=2)
+        output.write("\n")
+
+    if any(r.get("failed") or not r["checksum_ok"] for r in results):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+#
+# Size and startup cost of the string encryption on a large string table.
+#
+# Builds the templates kernel of kernels/ with clang and the plugin without any
+# pass, with the string encryption decoding each string with its own key and
+# with the strings compressed (LLVM_OBF_STRING_COMPRESS), then runs each
+# binary. The kernel prints the time from its start to main and a checksum,
+# which has to match the baseline one. The warm runs keep the best time, the
+# cold ones evict the pages of the binary from the page cache first (as far as
+# posix_fadvise can) and average the time and the major faults (page-ins).
+#
+# The results are written as JSON, with the ratios to the baseline:
+#
+# {"results": [{"mode": "compressed", "binary_size": ...,
+#               "time_to_main_ns": ..., "cold_time_to_main_ns": ...,
+#               "cold_page_ins": ..., "size_ratio": 0.6, ...}]}
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from run import SEED, build
+
+MODES = [("baseline", None, {}),
+         ("per-string", ["string-encryption"], {}),
+         ("compressed", ["string-encryption"],
+          {"LLVM_OBF_STRING_COMPRESS": "y"})]
+
+
+def evict(binary):
+    with open(binary, "rb") as file:
+        os.posix_fadvise(file.fileno(), 0, 0, os.POSIX_FADV_DONTNEED)
+
+
+def run(binary):
+    """Time to main, checksum and major faults of a run, None on failure"""
+    process = subprocess.Popen([binary, str(time.monotonic_ns())],
+                               stdout=subprocess.PIPE,
+                               universal_newlines=True)
+    output = process.stdout.read()
+    _, status, usage = os.wait4(process.pid, 0)
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+        return None
+    nanoseconds, checksum = output.split()
+    return int(nanoseconds), checksum, usage.ru_majflt
+
+
+def measure(args, binary):
+    warm = [run(binary) for _ in range(args.repeat)]
+    cold = []
+    for _ in range(args.cold_repeat):
+        evict(binary)
+        cold.append(run(binary))
+    if None in warm or None in cold:
+        return None
+    return {"binary_size": os.path.getsize(binary),
+            "time_to_main_ns": min(result[0] for result in warm),
+            "cold_time_to_main_ns": sum(result[0] for result in cold) /
+            len(cold),
+            "cold_page_ins": sum(result[2] for result in cold) / len(cold),
+            "checksum": warm[0][1]}
+
+
+def ratio(value, base):
+    return value / base if base else None
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Size and startup cost of the string encryption")
+    parser.add_argument("--clang", default="clang")
+    parser.add_argument("--plugin", required=True,
+                        help="path to libLLVMObfuscator.so")
+    parser.add_argument("--cflags", default="",
+                        help="additional clang flags")
+    parser.add_argument("--repeat", type=int, default=20,
+                        help="warm runs per binary, best time is kept")
+    parser.add_argument("--cold-repeat", type=int, default=5,
+                        help="runs per binary with its pages evicted first")
+    parser.add_argument("--output", default="startup.json")
+    args = parser.parse_args()
+
+    args.cflags = args.cflags.split()
+    args.plugin = os.path.abspath(args.plugin)
+
+    results = []
+    with tempfile.TemporaryDirectory() as directory:
+        binary = os.path.join(directory, "templates")
+        for mode, passes, options in MODES:
+            result = {"mode": mode}
+            measurement = None
+            if build(args, "templates", binary, passes, "OPTIMIZERLASTEP",
+                     options) is not None:
+                # Written back, so that the pages can be evicted
+                os.sync()
+                measurement = measure(args, binary)
+            if measurement is None:
+                print("%-10s failed" % mode)
+                result["failed"] = True
+                results.append(result)
+                continue
+
+            result.update(measurement)
+            base = results[0] if results else None
+            if base is not None and not base.get("failed"):
+                result["checksum_ok"] = (measurement["checksum"] ==
+                                         base["checksum"])
+                for metric in ["binary_size", "time_to_main_ns",
+                               "cold_time_to_main_ns", "cold_page_ins"]:
+                    name = metric.replace("_ns", "") + "_ratio"
+                    result[name] = ratio(measurement[metric], base[metric])
+            results.append(result)
+            print("%-10s %9d bytes  %8.1f us to main  %8.1f us cold  "
+                  "%6.1f page-ins%s" %
+                  (mode, result["binary_size"],
+                   result["time_to_main_ns"] / 1000,
+                   result["cold_time_to_main_ns"] / 1000,
+                   result["cold_page_ins"],
+                   "" if result.get("checksum_ok", True)
+                   else "  WRONG CHECKSUM"))
+
+    with open(args.output, "w") as output:
+        json.dump({"clang": args.clang, "seed": SEED, "results": results},
+                  output, indent=2)
+        output.write("\n")
+
+    if any(r.get("failed") or not r.get("checksum_ok", True)
+           for r in results):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
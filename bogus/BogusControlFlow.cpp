@@ -39,14 +39,21 @@
 //
 //  * The results of these terminator's branch's conditions are always true, but
 //    these predicates are opacificated.
-//    For this, we declare two global values: x and y, and replace
-//    the FCMP_TRUE predicate with (y < 10 || x * (x + 1) % 2 == 0) (this could
-//    be improved, as the global values give a hint on where are the opaque
-//    predicates)
+//    For this, we declare two global values: x and y, loaded once per
+//    function, and replace the FCMP_TRUE predicate with one of the predicates
+//    of OpaquePredicate, such as (y < 10 || x * (x + 1) % 2 == 0). An integer
+//    argument of a function that is not local replaces x. The blocks in a
+//    loop get the cheapest of the predicates allowed by -bcf_predicates, the
+//    other ones a random one.
 //
 //  The altered bloc is a copy of the original's one with junk instructions
 //  added accordingly to the type of instructions we found in the bloc
 //
+//  With -bcf_decoys=N, the false branches go to a pool of N decoy blocks per
+//  function instead of a clone each. A decoy is a short junk template which
+//  writes x and branches to the other decoys or returns, so the code grows by
+//  the predicates only and the pool is shared by all of them.
+//
 //  Each basic block of the function is choosen if a random number in the range
 //  [0,100] is smaller than the choosen probability rate. The default value
 //  is 30. This value can be modify using the option -boguscf-prob=[value].
@@ -95,8 +102,14 @@
 //===----------------------------------------------------------------------------------===//
 
 #include "BogusControlFlow.h"
+#include "budget/Budget.h"
 #include "utils/Utils.h"
 #include "utils/CryptoUtils.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/TimeProfiler.h"
 
 namespace llvm {
 
@@ -111,6 +124,7 @@ STATISTIC(NumAddedBasicBlocks,
           "e. Number of added basic blocks in this module");
 STATISTIC(FinalNumBasicBlocks,
           "f. Final number of basic blocks in this module");
+STATISTIC(NumSkipped, "g. Number of functions already obfuscated, skipped");
 
 // Options for the pass
 const int defaultObfRate = 30, defaultObfTime = 1;
@@ -128,6 +142,49 @@ static cl::opt<int>
              cl::value_desc("number of times"), cl::init(defaultObfTime),
              cl::Optional);
 
+static cl::opt<int> Decoys(
+    "bcf_decoys",
+    cl::desc("Choose the number of decoy blocks per function the -bcf pass "
+             "branches to instead of cloning each block, 0 to clone"),
+    cl::value_desc("number of decoys"), cl::init(0), cl::Optional);
+
+/* OpaquePredicate
+ *
+ * The always true predicates, from the cheapest to the most expensive. x and y
+ * are the opaque values, y being always 0.
+ */
+enum OpaquePredicate {
+  // y < 10
+  SmallY,
+  // (x * (x + 1)) & 1 == 0, a product of consecutive integers is even
+  Consecutive,
+  // (x * (x - 1)) % 2 == 0 || y < 10
+  Original,
+  // x * x != 7 * y * y - 1, squares modulo 8 are 0, 1 or 4
+  Squares,
+  NumPredicates
+};
+
+// Estimated latency [cycles] of each predicate, once x and y are loaded
+static const unsigned PredicateLatency[NumPredicates] = {1, 5, 6, 8};
+
+static cl::list<OpaquePredicate> AllowedPredicates(
+    "bcf_predicates", cl::CommaSeparated,
+    cl::desc("Choose the opaque predicates of the -bcf pass, all by default"),
+    cl::values(clEnumValN(SmallY, "small-y", "y < 10"),
+               clEnumValN(Consecutive, "consecutive", "x * (x + 1) is even"),
+               clEnumValN(Original, "original",
+                          "x * (x - 1) is even or y < 10"),
+               clEnumValN(Squares, "squares", "x * x != 7 * y * y - 1")));
+
+unsigned getAllowedPredicatesMask() {
+  unsigned mask = 0;
+  for (OpaquePredicate kind : AllowedPredicates) {
+    mask |= 1u << kind;
+  }
+  return mask;
+}
+
 BogusControlFlow::BogusControlFlow() {}
 BogusControlFlow::BogusControlFlow(bool flag) { this->flag = true; }
 
@@ -144,10 +201,20 @@ bool BogusControlFlow::runBogusControlFlow(Function &F) {
               "-bcf_prob=x must be 0 < x <= 100";
     return false;
   }
+  if (isObfuscated(&F, "bcf")) {
+    ++NumSkipped;
+    return false;
+  }
+
   // If fla annotations
   if (toObfuscate(flag, &F, "bcf")) {
+    ValueNamesScope names(F.getContext());
     bogus(F);
-    doF(*F.getParent());
+    {
+      TimeTraceScope scope("doF", F.getName());
+      doF(F);
+    }
+    markObfuscated(&F, "bcf");
     return true;
   }
 
@@ -179,6 +246,20 @@ void BogusControlFlow::bogus(Function &F) {
   }
   NumTimesOnFunctions = ObfTimes;
   int NumObfTimes = ObfTimes;
+  int probRate = plannedProbRate >= 0 ? plannedProbRate : (int)ObfProbRate;
+  decoys.clear();
+
+  // The blocks in a loop get the cheapest predicates
+  hotBlocks.clear();
+  {
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    for (BasicBlock &BB : F) {
+      if (LI.getLoopFor(&BB)) {
+        hotBlocks.insert(&BB);
+      }
+    }
+  }
 
   // Real begining of the pass
   // Loop for the number of time we run the pass on the function
@@ -189,7 +270,7 @@ void BogusControlFlow::bogus(Function &F) {
     // Put all the function's block in a list
     std::list<BasicBlock *> basicBlocks;
     for (Function::iterator i = F.begin(); i != F.end(); ++i) {
-      if (!i->isLandingPad() && !i->isEHPad()) {
+      if (!i->isLandingPad() && !i->isEHPad() && !is_contained(decoys, &*i)) {
         basicBlocks.push_back(&*i);
       }
     }
@@ -199,13 +280,13 @@ void BogusControlFlow::bogus(Function &F) {
     while (!basicBlocks.empty()) {
       NumBasicBlocks++;
       // Basic Blocks' selection
-      if ((int)llvm::cryptoutils->get_range(100) <= ObfProbRate) {
+      if ((int)llvm::cryptoutils->get_range(100) <= probRate) {
         DEBUG_WITH_TYPE("opt", errs() << "bcf: Block " << NumBasicBlocks
                                       << " selected. \n");
         hasBeenModified = true;
         ++NumModifiedBasicBlocks;
-        NumAddedBasicBlocks += 3;
-        FinalNumBasicBlocks += 3;
+        NumAddedBasicBlocks += useDecoys(F) ? 2 : 3;
+        FinalNumBasicBlocks += useDecoys(F) ? 2 : 3;
         // Add bogus flow to the given Basic Block (see description)
         BasicBlock *basicBlock = basicBlocks.front();
         addBogusFlow(basicBlock, F);
@@ -279,21 +360,29 @@ void BogusControlFlow::addBogusFlow(BasicBlock *basicBlock, Function &F) {
       return;
   }
 
-  Twine *var;
-  var = new Twine("originalBB");
-  BasicBlock *originalBB = basicBlock->splitBasicBlock(i1, *var);
+  BasicBlock *originalBB = basicBlock->splitBasicBlock(i1, "originalBB");
   DEBUG_WITH_TYPE("gen", errs()
                              << "bcf: First and original basic blocks: ok\n");
 
-  // Creating the altered basic block on which the first basicBlock will jump
-  Twine *var3 = new Twine("alteredBB");
-  BasicBlock *alteredBB = createAlteredBasicBlock(originalBB, *var3, &F);
+  // Creating the altered basic block on which the first basicBlock will jump,
+  // or taking decoys from the pool, one for each of the false branches
+  bool decoy = useDecoys(F);
+  BasicBlock *alteredBB, *alteredBB2;
+  if (decoy) {
+    alteredBB = getDecoy(F);
+    alteredBB2 = getDecoy(F);
+  } else {
+    alteredBB = createAlteredBasicBlock(originalBB, "alteredBB", &F);
+    alteredBB2 = alteredBB;
+  }
   DEBUG_WITH_TYPE("gen", errs() << "bcf: Altered basic block: ok\n");
 
   // Now that all the blocks are created,
   // we modify the terminators to adjust the control flow.
 
-  alteredBB->getTerminator()->eraseFromParent();
+  if (!decoy) {
+    alteredBB->getTerminator()->eraseFromParent();
+  }
   basicBlock->getTerminator()->eraseFromParent();
   DEBUG_WITH_TYPE("gen", errs() << "bcf: Terminator removed from the altered"
                                 << " and first basic blocks\n");
@@ -306,9 +395,8 @@ void BogusControlFlow::addBogusFlow(BasicBlock *basicBlock, Function &F) {
   DEBUG_WITH_TYPE("gen", errs() << "bcf: Value LHS and RHS created\n");
 
   // The always true condition. End of the first block
-  Twine *var4 = new Twine("condition");
   FCmpInst *condition =
-      new FCmpInst(basicBlock, FCmpInst::FCMP_TRUE, LHS, RHS, *var4);
+      new FCmpInst(basicBlock, FCmpInst::FCMP_TRUE, LHS, RHS, "condition");
   DEBUG_WITH_TYPE("gen", errs() << "bcf: Always true condition created\n");
 
   // Jump to the original basic block if the condition is true or
@@ -319,7 +407,9 @@ void BogusControlFlow::addBogusFlow(BasicBlock *basicBlock, Function &F) {
       errs() << "bcf: Terminator instruction in first basic block: ok\n");
 
   // The altered block loop back on the original one.
-  BranchInst::Create(originalBB, alteredBB);
+  if (!decoy) {
+    BranchInst::Create(originalBB, alteredBB);
+  }
   DEBUG_WITH_TYPE(
       "gen", errs() << "bcf: Terminator instruction in altered block: ok\n");
 
@@ -333,8 +423,8 @@ void BogusControlFlow::addBogusFlow(BasicBlock *basicBlock, Function &F) {
   BasicBlock::iterator i = originalBB->end();
 
   // Split at this point (we only want the terminator in the second part)
-  Twine *var5 = new Twine("originalBBpart2");
-  BasicBlock *originalBBpart2 = originalBB->splitBasicBlock(--i, *var5);
+  BasicBlock *originalBBpart2 =
+      originalBB->splitBasicBlock(--i, "originalBBpart2");
   DEBUG_WITH_TYPE("gen",
                   errs() << "bcf: Terminator part of the original basic block"
                          << " is isolated\n");
@@ -342,335 +432,442 @@ void BogusControlFlow::addBogusFlow(BasicBlock *basicBlock, Function &F) {
   // of the altered block.. So we erase the terminator created when splitting.
   originalBB->getTerminator()->eraseFromParent();
   // We add at the end a new always true condition
-  Twine *var6 = new Twine("condition2");
   FCmpInst *condition2 =
-      new FCmpInst(originalBB, CmpInst::FCMP_TRUE, LHS, RHS, *var6);
-  BranchInst::Create(originalBBpart2, alteredBB, (Value *)condition2,
+      new FCmpInst(originalBB, CmpInst::FCMP_TRUE, LHS, RHS, "condition2");
+  BranchInst::Create(originalBBpart2, alteredBB2, (Value *)condition2,
                      originalBB);
+  if (hotBlocks.count(basicBlock)) {
+    hotBlocks.insert(originalBB);
+    hotBlocks.insert(originalBBpart2);
+  }
   DEBUG_WITH_TYPE("gen", errs()
                              << "bcf: Terminator original basic block: ok\n");
   DEBUG_WITH_TYPE("gen", errs() << "bcf: End of addBogusFlow().\n");
 
 } // end of addBogusFlow()
 
-BasicBlock *BogusControlFlow::createAlteredBasicBlock(BasicBlock *basicBlock,
-                                                      const Twine &Name,
-                                                      Function *F) {
-  // Useful to remap the informations concerning instructions.
-  ValueToValueMapTy VMap;
-  BasicBlock *alteredBB = llvm::CloneBasicBlock(basicBlock, VMap, Name, F);
-  DEBUG_WITH_TYPE("gen", errs() << "bcf: Original basic block cloned\n");
-  // Remap operands.
-  BasicBlock::iterator ji = basicBlock->begin();
-  for (BasicBlock::iterator i = alteredBB->begin(), e = alteredBB->end();
-       i != e; ++i) {
-    // Loop over the operands of the instruction
-    for (User::op_iterator opi = i->op_begin(), ope = i->op_end(); opi != ope;
-         ++opi) {
-      // get the value for the operand
-      Value *v = MapValue(*opi, VMap, RF_NoModuleLevelChanges, 0);
-      if (v != 0) {
-        *opi = v;
-        DEBUG_WITH_TYPE("gen", errs()
-                                   << "bcf: Value's operand has been setted\n");
-      }
+// The i32 global holding an opaque value, shared by the functions of M. Only
+// a global of our own is reused, never a user one of the same name.
+static GlobalVariable *getOpaqueGlobal(Module &M, StringRef name) {
+  Type *i32 = Type::getInt32Ty(M.getContext());
+  GlobalVariable *GV = M.getGlobalVariable(name, true);
+  if (GV && GV->getValueType() == i32 && GV->hasCommonLinkage()) {
+    return GV;
+  }
+  return new GlobalVariable(M, i32, false, GlobalValue::CommonLinkage,
+                            ConstantInt::get(i32, 0), name);
+}
+
+// Decoys need a way out of their pool, which a function that does not return
+// has not
+bool BogusControlFlow::useDecoys(Function &F) {
+  return Decoys > 0 && !F.doesNotReturn();
+}
+
+BasicBlock *BogusControlFlow::getDecoy(Function &F) {
+  if (decoys.empty()) {
+    createDecoys(F);
+  }
+  return decoys[llvm::cryptoutils->get_range(decoys.size())];
+}
+
+void BogusControlFlow::createDecoys(Function &F) {
+  LLVMContext &ctx = F.getContext();
+  for (int i = 0; i < Decoys; ++i) {
+    decoys.push_back(BasicBlock::Create(ctx, "decoyBB", &F));
+  }
+  NumAddedBasicBlocks += decoys.size();
+  FinalNumBasicBlocks += decoys.size();
+
+  // x = junk(x), then on to the next decoy or to a random one, the last one
+  // returns
+  GlobalVariable *x = getOpaqueGlobal(*F.getParent(), "obf.x");
+  Type *retType = F.getReturnType();
+  static const Instruction::BinaryOps ops[] = {
+      Instruction::Add, Instruction::Sub, Instruction::Xor, Instruction::Mul};
+  IRBuilder<> builder(ctx);
+  for (size_t i = 0; i < decoys.size(); ++i) {
+    builder.SetInsertPoint(decoys[i]);
+    Value *v = builder.CreateLoad(x->getValueType(), x);
+    for (int j = 0; j < 3; ++j) {
+      uint32_t k = llvm::cryptoutils->get_uint32_t();
+      v = builder.CreateBinOp(ops[llvm::cryptoutils->get_range(4)], v,
+                              builder.getInt32(k));
     }
-    DEBUG_WITH_TYPE("gen", errs() << "bcf: Operands remapped\n");
-    // Remap phi nodes' incoming blocks.
-    if (PHINode *pn = dyn_cast<PHINode>(i)) {
-      for (unsigned j = 0, e = pn->getNumIncomingValues(); j != e; ++j) {
-        Value *v = MapValue(pn->getIncomingBlock(j), VMap, RF_None, 0);
-        if (v != 0) {
-          pn->setIncomingBlock(j, cast<BasicBlock>(v));
-        }
-      }
+    builder.CreateStore(v, x);
+
+    if (i + 1 < decoys.size()) {
+      Value *cond = builder.CreateICmpSLT(
+          v, builder.getInt32(llvm::cryptoutils->get_uint32_t()));
+      builder.CreateCondBr(
+          cond, decoys[i + 1],
+          decoys[llvm::cryptoutils->get_range(decoys.size())]);
+    } else if (retType->isVoidTy()) {
+      builder.CreateRetVoid();
+    } else if (retType->isIntegerTy()) {
+      builder.CreateRet(builder.CreateZExtOrTrunc(v, retType));
+    } else {
+      builder.CreateRet(Constant::getNullValue(retType));
     }
-    DEBUG_WITH_TYPE("gen", errs() << "bcf: PHINodes remapped\n");
-    // Remap attached metadata.
-    SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
-    i->getAllMetadata(MDs);
-    DEBUG_WITH_TYPE("gen", errs() << "bcf: Metadatas remapped\n");
-    // important for compiling with DWARF, using option -g.
-    i->setDebugLoc(ji->getDebugLoc());
-    ji++;
-    DEBUG_WITH_TYPE("gen", errs()
-                               << "bcf: Debug information location setted\n");
-
-  } // The instructions' informations are now all correct
+  }
+}
 
-  DEBUG_WITH_TYPE("gen", errs()
-                             << "bcf: The cloned basic block is now correct\n");
-  DEBUG_WITH_TYPE(
-      "gen",
-      errs() << "bcf: Starting to add junk code in the cloned bloc...\n");
-
-  // add random instruction in the middle of the bloc. This part can be
-  // improve
-  for (BasicBlock::iterator i = alteredBB->begin(), e = alteredBB->end();
-       i != e; ++i) {
-    // in the case we find binary operator, we modify slightly this part by
-    // randomly insert some instructions
-    if (i->isBinaryOp()) { // binary instructions
-      unsigned opcode = i->getOpcode();
-      BinaryOperator *op, *op1 = NULL;
-      UnaryOperator *op2;
-      Twine *var = new Twine("_");
-      // treat differently float or int
-      // Binary int
-      if (opcode == Instruction::Add || opcode == Instruction::Sub ||
-          opcode == Instruction::Mul || opcode == Instruction::UDiv ||
-          opcode == Instruction::SDiv || opcode == Instruction::URem ||
-          opcode == Instruction::SRem || opcode == Instruction::Shl ||
-          opcode == Instruction::LShr || opcode == Instruction::AShr ||
-          opcode == Instruction::And || opcode == Instruction::Or ||
-          opcode == Instruction::Xor) {
-        for (int random = (int)llvm::cryptoutils->get_range(10); random < 10;
-             ++random) {
-          switch (llvm::cryptoutils->get_range(4)) { // to improve
-          case 0:                                    // do nothing
-            break;
-          case 1:
-            op = BinaryOperator::CreateNeg(i->getOperand(0), *var, &*i);
-            op1 = BinaryOperator::Create(Instruction::Add, op, i->getOperand(1),
-                                         "gen", &*i);
-            break;
-          case 2:
-            op1 = BinaryOperator::Create(Instruction::Sub, i->getOperand(0),
-                                         i->getOperand(1), *var, &*i);
-            op = BinaryOperator::Create(Instruction::Mul, op1, i->getOperand(1),
-                                        "gen", &*i);
-            break;
-          case 3:
-            op = BinaryOperator::Create(Instruction::Shl, i->getOperand(0),
-                                        i->getOperand(1), *var, &*i);
-            break;
-          }
-        }
-      }
-      // Binary float
-      if (opcode == Instruction::FAdd || opcode == Instruction::FSub ||
-          opcode == Instruction::FMul || opcode == Instruction::FDiv ||
-          opcode == Instruction::FRem) {
-        for (int random = (int)llvm::cryptoutils->get_range(10); random < 10;
-             ++random) {
-          switch (llvm::cryptoutils->get_range(3)) { // can be improved
-          case 0:                                    // do nothing
-            break;
-          case 1:
-            op2 = UnaryOperator::CreateFNeg(i->getOperand(0), *var, &*i);
-            op1 = BinaryOperator::Create(Instruction::FAdd, op2,
-                                         i->getOperand(1), "gen", &*i);
-            break;
-          case 2:
-            op = BinaryOperator::Create(Instruction::FSub, i->getOperand(0),
-                                        i->getOperand(1), *var, &*i);
-            op1 = BinaryOperator::Create(Instruction::FMul, op,
-                                         i->getOperand(1), "gen", &*i);
-            break;
-          }
-        }
-      }
-      if (opcode == Instruction::ICmp) { // Condition (with int)
-        ICmpInst *currentI = (ICmpInst *)(&i);
-        switch (llvm::cryptoutils->get_range(3)) { // must be improved
+/* addJunk
+ *
+ * Add junk instructions before a binary operator of the altered block, and
+ * swap or change the predicate of a comparison
+ */
+static void addJunk(Instruction *I) {
+  // in the case we find binary operator, we modify slightly this part by
+  // randomly insert some instructions
+  if (I->isBinaryOp()) { // binary instructions
+    unsigned opcode = I->getOpcode();
+    BinaryOperator *op, *op1 = NULL;
+    UnaryOperator *op2;
+    // treat differently float or int
+    // Binary int
+    if (opcode == Instruction::Add || opcode == Instruction::Sub ||
+        opcode == Instruction::Mul || opcode == Instruction::UDiv ||
+        opcode == Instruction::SDiv || opcode == Instruction::URem ||
+        opcode == Instruction::SRem || opcode == Instruction::Shl ||
+        opcode == Instruction::LShr || opcode == Instruction::AShr ||
+        opcode == Instruction::And || opcode == Instruction::Or ||
+        opcode == Instruction::Xor) {
+      for (int random = (int)llvm::cryptoutils->get_range(10); random < 10;
+           ++random) {
+        switch (llvm::cryptoutils->get_range(4)) { // to improve
         case 0:                                    // do nothing
           break;
         case 1:
-          currentI->swapOperands();
+          op = BinaryOperator::CreateNeg(I->getOperand(0), "_", I);
+          op1 = BinaryOperator::Create(Instruction::Add, op, I->getOperand(1),
+                                       "gen", I);
+          break;
+        case 2:
+          op1 = BinaryOperator::Create(Instruction::Sub, I->getOperand(0),
+                                       I->getOperand(1), "_", I);
+          op = BinaryOperator::Create(Instruction::Mul, op1, I->getOperand(1),
+                                      "gen", I);
           break;
-        case 2: // randomly change the predicate
-          switch (llvm::cryptoutils->get_range(10)) {
-          case 0:
-            currentI->setPredicate(ICmpInst::ICMP_EQ);
-            break; // equal
-          case 1:
-            currentI->setPredicate(ICmpInst::ICMP_NE);
-            break; // not equal
-          case 2:
-            currentI->setPredicate(ICmpInst::ICMP_UGT);
-            break; // unsigned greater than
-          case 3:
-            currentI->setPredicate(ICmpInst::ICMP_UGE);
-            break; // unsigned greater or equal
-          case 4:
-            currentI->setPredicate(ICmpInst::ICMP_ULT);
-            break; // unsigned less than
-          case 5:
-            currentI->setPredicate(ICmpInst::ICMP_ULE);
-            break; // unsigned less or equal
-          case 6:
-            currentI->setPredicate(ICmpInst::ICMP_SGT);
-            break; // signed greater than
-          case 7:
-            currentI->setPredicate(ICmpInst::ICMP_SGE);
-            break; // signed greater or equal
-          case 8:
-            currentI->setPredicate(ICmpInst::ICMP_SLT);
-            break; // signed less than
-          case 9:
-            currentI->setPredicate(ICmpInst::ICMP_SLE);
-            break; // signed less or equal
-          }
+        case 3:
+          op = BinaryOperator::Create(Instruction::Shl, I->getOperand(0),
+                                      I->getOperand(1), "_", I);
           break;
         }
       }
-      if (opcode == Instruction::FCmp) { // Conditions (with float)
-        FCmpInst *currentI = (FCmpInst *)(&i);
-        switch (llvm::cryptoutils->get_range(3)) { // must be improved
+    }
+    // Binary float
+    if (opcode == Instruction::FAdd || opcode == Instruction::FSub ||
+        opcode == Instruction::FMul || opcode == Instruction::FDiv ||
+        opcode == Instruction::FRem) {
+      for (int random = (int)llvm::cryptoutils->get_range(10); random < 10;
+           ++random) {
+        switch (llvm::cryptoutils->get_range(3)) { // can be improved
         case 0:                                    // do nothing
           break;
         case 1:
-          currentI->swapOperands();
+          op2 = UnaryOperator::CreateFNeg(I->getOperand(0), "_", I);
+          op1 = BinaryOperator::Create(Instruction::FAdd, op2,
+                                       I->getOperand(1), "gen", I);
           break;
-        case 2: // randomly change the predicate
-          switch (llvm::cryptoutils->get_range(10)) {
-          case 0:
-            currentI->setPredicate(FCmpInst::FCMP_OEQ);
-            break; // ordered and equal
-          case 1:
-            currentI->setPredicate(FCmpInst::FCMP_ONE);
-            break; // ordered and operands are unequal
-          case 2:
-            currentI->setPredicate(FCmpInst::FCMP_UGT);
-            break; // unordered or greater than
-          case 3:
-            currentI->setPredicate(FCmpInst::FCMP_UGE);
-            break; // unordered, or greater than, or equal
-          case 4:
-            currentI->setPredicate(FCmpInst::FCMP_ULT);
-            break; // unordered or less than
-          case 5:
-            currentI->setPredicate(FCmpInst::FCMP_ULE);
-            break; // unordered, or less than, or equal
-          case 6:
-            currentI->setPredicate(FCmpInst::FCMP_OGT);
-            break; // ordered and greater than
-          case 7:
-            currentI->setPredicate(FCmpInst::FCMP_OGE);
-            break; // ordered and greater than or equal
-          case 8:
-            currentI->setPredicate(FCmpInst::FCMP_OLT);
-            break; // ordered and less than
-          case 9:
-            currentI->setPredicate(FCmpInst::FCMP_OLE);
-            break; // ordered or less than, or equal
-          }
+        case 2:
+          op = BinaryOperator::Create(Instruction::FSub, I->getOperand(0),
+                                      I->getOperand(1), "_", I);
+          op1 = BinaryOperator::Create(Instruction::FMul, op,
+                                       I->getOperand(1), "gen", I);
           break;
         }
       }
     }
   }
+  if (ICmpInst *currentI = dyn_cast<ICmpInst>(I)) { // Condition (with int)
+    switch (llvm::cryptoutils->get_range(3)) { // must be improved
+    case 0:                                    // do nothing
+      break;
+    case 1:
+      currentI->swapOperands();
+      break;
+    case 2: // randomly change the predicate
+      switch (llvm::cryptoutils->get_range(10)) {
+      case 0:
+        currentI->setPredicate(ICmpInst::ICMP_EQ);
+        break; // equal
+      case 1:
+        currentI->setPredicate(ICmpInst::ICMP_NE);
+        break; // not equal
+      case 2:
+        currentI->setPredicate(ICmpInst::ICMP_UGT);
+        break; // unsigned greater than
+      case 3:
+        currentI->setPredicate(ICmpInst::ICMP_UGE);
+        break; // unsigned greater or equal
+      case 4:
+        currentI->setPredicate(ICmpInst::ICMP_ULT);
+        break; // unsigned less than
+      case 5:
+        currentI->setPredicate(ICmpInst::ICMP_ULE);
+        break; // unsigned less or equal
+      case 6:
+        currentI->setPredicate(ICmpInst::ICMP_SGT);
+        break; // signed greater than
+      case 7:
+        currentI->setPredicate(ICmpInst::ICMP_SGE);
+        break; // signed greater or equal
+      case 8:
+        currentI->setPredicate(ICmpInst::ICMP_SLT);
+        break; // signed less than
+      case 9:
+        currentI->setPredicate(ICmpInst::ICMP_SLE);
+        break; // signed less or equal
+      }
+      break;
+    }
+  }
+  if (FCmpInst *currentI = dyn_cast<FCmpInst>(I)) { // Conditions (with float)
+    switch (llvm::cryptoutils->get_range(3)) { // must be improved
+    case 0:                                    // do nothing
+      break;
+    case 1:
+      currentI->swapOperands();
+      break;
+    case 2: // randomly change the predicate
+      switch (llvm::cryptoutils->get_range(10)) {
+      case 0:
+        currentI->setPredicate(FCmpInst::FCMP_OEQ);
+        break; // ordered and equal
+      case 1:
+        currentI->setPredicate(FCmpInst::FCMP_ONE);
+        break; // ordered and operands are unequal
+      case 2:
+        currentI->setPredicate(FCmpInst::FCMP_UGT);
+        break; // unordered or greater than
+      case 3:
+        currentI->setPredicate(FCmpInst::FCMP_UGE);
+        break; // unordered, or greater than, or equal
+      case 4:
+        currentI->setPredicate(FCmpInst::FCMP_ULT);
+        break; // unordered or less than
+      case 5:
+        currentI->setPredicate(FCmpInst::FCMP_ULE);
+        break; // unordered, or less than, or equal
+      case 6:
+        currentI->setPredicate(FCmpInst::FCMP_OGT);
+        break; // ordered and greater than
+      case 7:
+        currentI->setPredicate(FCmpInst::FCMP_OGE);
+        break; // ordered and greater than or equal
+      case 8:
+        currentI->setPredicate(FCmpInst::FCMP_OLT);
+        break; // ordered and less than
+      case 9:
+        currentI->setPredicate(FCmpInst::FCMP_OLE);
+        break; // ordered or less than, or equal
+      }
+      break;
+    }
+  }
+}
+
+BasicBlock *BogusControlFlow::createAlteredBasicBlock(BasicBlock *basicBlock,
+                                                      const Twine &Name,
+                                                      Function *F) {
+  TimeTraceScope scope("createAlteredBasicBlock", F->getName());
+
+  // Clone, remap and add junk code in a single walk of the block. The
+  // operands defined earlier in the block are remapped as the instructions
+  // are cloned, the ones of the phi nodes, which may be defined later, once
+  // the block is complete. The block never runs: the debug intrinsics are
+  // left out and the clones keep the metadata of the original instructions.
+  BasicBlock *alteredBB = BasicBlock::Create(
+      F->getContext(),
+      basicBlock->hasName() ? basicBlock->getName() + Name : "", F);
+  DenseMap<const Value *, Value *> VMap;
+  SmallVector<PHINode *, 4> phis;
+  for (Instruction &I : *basicBlock) {
+    if (isa<DbgInfoIntrinsic>(I)) {
+      continue;
+    }
+    Instruction *clone = I.clone();
+    if (I.hasName()) {
+      clone->setName(I.getName() + Name);
+    }
+#if LLVM_VERSION_MAJOR >= 16
+    clone->insertInto(alteredBB, alteredBB->end());
+#else
+    alteredBB->getInstList().push_back(clone);
+#endif
+    VMap[&I] = clone;
+
+    if (PHINode *pn = dyn_cast<PHINode>(clone)) {
+      phis.push_back(pn);
+      continue;
+    }
+    for (Use &U : clone->operands()) {
+      if (Value *v = VMap.lookup(U.get())) {
+        U.set(v);
+      }
+    }
+    addJunk(clone);
+  }
+
+  for (PHINode *pn : phis) {
+    for (Use &U : pn->incoming_values()) {
+      if (Value *v = VMap.lookup(U.get())) {
+        U.set(v);
+      }
+    }
+  }
+  DEBUG_WITH_TYPE("gen", errs() << "bcf: Altered basic block cloned\n");
+
   return alteredBB;
 } // end of createAlteredBasicBlock()
 
-/* doFinalization
+/* OpaqueValues
  *
- * Overwrite FunctionPass method to apply the transformations to the whole
- * module. This part obfuscate all the always true predicates of the module.
- * More precisely, the condition which predicate is FCMP_TRUE.
- * It also remove all the functions' basic blocks' and instructions' names.
+ * x and y, materialized once per function in its entry block. x is an integer
+ * argument when the function is visible outside of its module, since no
+ * caller can then be seen to propagate a constant into it, or a load of
+ * obf.x. y is a load of obf.y, which is always 0.
  */
-bool BogusControlFlow::doF(Module &M) {
-  // In this part we extract all always-true predicate and replace them with
-  // opaque predicate: For this, we declare two global values: x and y, and
-  // replace the FCMP_TRUE predicate with (y < 10 || x * (x + 1) % 2 == 0) A
-  // better way to obfuscate the predicates would be welcome. In the meantime
-  // we will erase the name of the basic blocks, the instructions and the
-  // functions.
-  DEBUG_WITH_TYPE("gen", errs() << "bcf: Starting doFinalization...\n");
-
-  //  The global values
-  Twine *varX = new Twine("x");
-  Twine *varY = new Twine("y");
-  Value *x1 = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0, false);
-  Value *y1 = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0, false);
-
-  GlobalVariable *x =
-      new GlobalVariable(M, Type::getInt32Ty(M.getContext()), false,
-                         GlobalValue::CommonLinkage, (Constant *)x1, *varX);
-  GlobalVariable *y =
-      new GlobalVariable(M, Type::getInt32Ty(M.getContext()), false,
-                         GlobalValue::CommonLinkage, (Constant *)y1, *varY);
-
-  std::vector<Instruction *> toEdit, toDelete;
-  BinaryOperator *op, *op1 = NULL;
-  LoadInst *opX, *opY;
-  ICmpInst *condition, *condition2;
-  // Looking for the conditions and branches to transform
-  for (Module::iterator mi = M.begin(), me = M.end(); mi != me; ++mi) {
-    for (Function::iterator fi = mi->begin(), fe = mi->end(); fi != fe; ++fi) {
-      // fi->setName("");
-      Instruction *tbb = fi->getTerminator();
-      if (tbb->getOpcode() == Instruction::Br) {
-        BranchInst *br = (BranchInst *)(tbb);
-        if (br->isConditional()) {
-          FCmpInst *cond = (FCmpInst *)br->getCondition();
-          unsigned opcode = cond->getOpcode();
-          if (opcode == Instruction::FCmp) {
-            if (cond->getPredicate() == FCmpInst::FCMP_TRUE) {
-              DEBUG_WITH_TYPE("gen",
-                              errs() << "bcf: an always true predicate !\n");
-              toDelete.push_back(cond); // The condition
-              toEdit.push_back(tbb);    // The branch using the condition
-            }
-          }
+namespace {
+struct OpaqueValues {
+  OpaqueValues(Function &F)
+      : F(F), builder(F.getContext()), x(nullptr), y(nullptr) {}
+
+  // After the allocas of the entry block, looked up again for each value as
+  // the instructions there may be erased in between
+  void setInsertPoint() {
+    BasicBlock &entry = F.getEntryBlock();
+    BasicBlock::iterator ip = entry.getFirstInsertionPt();
+    while (isa<AllocaInst>(ip)) {
+      ++ip;
+    }
+    builder.SetInsertPoint(&entry, ip);
+  }
+
+  Value *getX() {
+    if (x) {
+      return x;
+    }
+    setInsertPoint();
+    if (!F.hasLocalLinkage()) {
+      for (Argument &arg : F.args()) {
+        if (arg.getType()->isIntegerTy()) {
+          return x = builder.CreateZExtOrTrunc(&arg, builder.getInt32Ty());
         }
       }
-      /*
-      for (BasicBlock::iterator bi = fi->begin(), be = fi->end() ; bi != be;
-      ++bi){ bi->setName(""); // setting the basic blocks' names
+    }
+    GlobalVariable *GV = getOpaqueGlobal(*F.getParent(), "obf.x");
+    return x = builder.CreateLoad(GV->getValueType(), GV);
+  }
+
+  Value *getY() {
+    if (!y) {
+      setInsertPoint();
+      GlobalVariable *GV = getOpaqueGlobal(*F.getParent(), "obf.y");
+      y = builder.CreateLoad(GV->getValueType(), GV);
+    }
+    return y;
+  }
+
+  Function &F;
+  IRBuilder<> builder;
+  Value *x;
+  Value *y;
+};
+} // namespace
+
+// Builds the always true predicate kind before the branch br
+static Value *createOpaquePredicate(OpaquePredicate kind, OpaqueValues &values,
+                                    BranchInst *br) {
+  Value *x = kind == SmallY ? nullptr : values.getX();
+  Value *y = kind == Consecutive ? nullptr : values.getY();
+  IRBuilder<> builder(br);
+  switch (kind) {
+  case SmallY:
+    return builder.CreateICmpSLT(y, builder.getInt32(10));
+  case Consecutive: {
+    Value *product =
+        builder.CreateMul(x, builder.CreateAdd(x, builder.getInt32(1)));
+    return builder.CreateICmpEQ(builder.CreateAnd(product, builder.getInt32(1)),
+                                builder.getInt32(0));
+  }
+  case Original: {
+    Value *product =
+        builder.CreateMul(x, builder.CreateSub(x, builder.getInt32(1)));
+    Value *even = builder.CreateICmpEQ(
+        builder.CreateURem(product, builder.getInt32(2)), builder.getInt32(0));
+    return builder.CreateOr(even,
+                            builder.CreateICmpSLT(y, builder.getInt32(10)));
+  }
+  default: {
+    Value *square = builder.CreateMul(builder.CreateMul(y, y),
+                                      builder.getInt32(7));
+    return builder.CreateICmpNE(builder.CreateMul(x, x),
+                                builder.CreateSub(square, builder.getInt32(1)));
+  }
+  }
+}
+
+/* doF
+ *
+ * Replace the always true predicates of F, the conditions which predicate is
+ * FCMP_TRUE, with opaque predicates on x and y.
+ */
+bool BogusControlFlow::doF(Function &F) {
+  DEBUG_WITH_TYPE("gen", errs() << "bcf: Starting doF...\n");
+
+  SmallVector<BranchInst *, 16> toEdit;
+  for (BasicBlock &BB : F) {
+    BranchInst *br = dyn_cast<BranchInst>(BB.getTerminator());
+    if (br && br->isConditional()) {
+      FCmpInst *cond = dyn_cast<FCmpInst>(br->getCondition());
+      if (cond && cond->getPredicate() == FCmpInst::FCMP_TRUE) {
+        DEBUG_WITH_TYPE("gen", errs() << "bcf: an always true predicate !\n");
+        toEdit.push_back(br);
       }
-      */
     }
   }
-  // Replacing all the branches we found
-  for (std::vector<Instruction *>::iterator i = toEdit.begin();
-       i != toEdit.end(); ++i) {
-    // if y < 10 || x*(x+1) % 2 == 0
-    opX = new LoadInst(x->getValueType(), (Value *)x, "", (*i));
-    opY = new LoadInst(y->getValueType(), (Value *)y, "", (*i));
-
-    op = BinaryOperator::Create(
-        Instruction::Sub, (Value *)opX,
-        ConstantInt::get(Type::getInt32Ty(M.getContext()), 1, false), "", (*i));
-    op1 = BinaryOperator::Create(Instruction::Mul, (Value *)opX, op, "", (*i));
-    op = BinaryOperator::Create(
-        Instruction::URem, op1,
-        ConstantInt::get(Type::getInt32Ty(M.getContext()), 2, false), "", (*i));
-    condition = new ICmpInst(
-        (*i), ICmpInst::ICMP_EQ, op,
-        ConstantInt::get(Type::getInt32Ty(M.getContext()), 0, false));
-    condition2 = new ICmpInst(
-        (*i), ICmpInst::ICMP_SLT, opY,
-        ConstantInt::get(Type::getInt32Ty(M.getContext()), 10, false));
-    op1 = BinaryOperator::Create(Instruction::Or, (Value *)condition,
-                                 (Value *)condition2, "", (*i));
-
-    BranchInst::Create(((BranchInst *)*i)->getSuccessor(0),
-                       ((BranchInst *)*i)->getSuccessor(1), (Value *)op1,
-                       ((BranchInst *)*i)->getParent());
-    DEBUG_WITH_TYPE("gen", errs() << "bcf: Erase branch instruction:"
-                                  << *((BranchInst *)*i) << "\n");
-    (*i)->eraseFromParent(); // erase the branch
-  }
-  // Erase all the associated conditions we found
-  for (std::vector<Instruction *>::iterator i = toDelete.begin();
-       i != toDelete.end(); ++i) {
-    DEBUG_WITH_TYPE("gen", errs() << "bcf: Erase condition instruction:"
-                                  << *((Instruction *)*i) << "\n");
-    (*i)->eraseFromParent();
+  if (toEdit.empty()) {
+    return false;
   }
 
-  // Only for debug
-  DEBUG_WITH_TYPE("cfg", errs() << "bcf: End of the pass, here are the "
-                                   "graphs after doFinalization\n");
-  for (Module::iterator mi = M.begin(), me = M.end(); mi != me; ++mi) {
-    DEBUG_WITH_TYPE("cfg", errs() << "bcf: Function " << mi->getName() << "\n");
-    DEBUG_WITH_TYPE("cfg", mi->viewCFG());
+  // The predicates to choose from, the cheapest first
+  SmallVector<OpaquePredicate, NumPredicates> allowed;
+  for (unsigned kind = 0; kind < NumPredicates; ++kind) {
+    if (AllowedPredicates.empty() ||
+        is_contained(AllowedPredicates, (OpaquePredicate)kind)) {
+      allowed.push_back((OpaquePredicate)kind);
+    }
+  }
+  if (allowed.empty()) {
+    allowed.push_back(Original);
+  }
+  llvm::stable_sort(allowed, [](OpaquePredicate a, OpaquePredicate b) {
+    return PredicateLatency[a] < PredicateLatency[b];
+  });
+
+  OpaqueValues values(F);
+  for (BranchInst *br : toEdit) {
+    OpaquePredicate kind =
+        hotBlocks.count(br->getParent())
+            ? allowed[0]
+            : allowed[llvm::cryptoutils->get_range(allowed.size())];
+    Instruction *cond = cast<Instruction>(br->getCondition());
+    br->setCondition(createOpaquePredicate(kind, values, br));
+    DEBUG_WITH_TYPE("gen", errs() << "bcf: Erase condition instruction:"
+                                  << *cond << "\n");
+    if (cond->use_empty()) {
+      cond->eraseFromParent();
+    }
   }
 
+  DEBUG_WITH_TYPE("cfg", errs() << "bcf: End of the pass, here is the graph "
+                                   "after doF\n");
+  DEBUG_WITH_TYPE("cfg", F.viewCFG());
+
   return true;
-} // end of doFinalization
+} // end of doF
 
 LegacyBogusControlFlow::LegacyBogusControlFlow() : FunctionPass(ID) {}
 LegacyBogusControlFlow::LegacyBogusControlFlow(bool flag) : FunctionPass(ID) {
@@ -694,6 +891,12 @@ BogusControlFlowPass::BogusControlFlowPass() {
 
 PreservedAnalyses BogusControlFlowPass::run(Function &F,
                                             FunctionAnalysisManager &AM) {
+  const ObfuscationIntensity *intensity = getPlannedIntensity(F, AM);
+  plannedProbRate = intensity ? intensity->bcfProb : -1;
+  if (plannedProbRate == 0) {
+    return PreservedAnalyses::all();
+  }
+
   return runBogusControlFlow(F) ? PreservedAnalyses::none()
                                 : PreservedAnalyses::all();
 }
@@ -15,6 +15,8 @@
 #define _BOGUSCONTROLFLOW_H_
 
 // LLVM include
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/CodeGen/ISDOpcodes.h"
 #include "llvm/IR/BasicBlock.h"
@@ -40,6 +42,8 @@ struct BogusControlFlow {
   BogusControlFlow();
   BogusControlFlow(bool flag);
   bool flag;
+  // Probability [%] of each block given by the budget, bcf_prob if negative
+  int plannedProbRate = -1;
 
   bool runBogusControlFlow(Function &F);
   void bogus(Function &F);
@@ -64,16 +68,35 @@ struct BogusControlFlow {
                                       const Twine &Name = "gen",
                                       Function *F = 0);
 
-  /* doFinalization
+  /* getDecoy
    *
-   * Overwrite FunctionPass method to apply the transformations to the whole
-   * module. This part obfuscate all the always true predicates of the module.
-   * More precisely, the condition which predicate is FCMP_TRUE.
-   * It also remove all the functions' basic blocks' and instructions' names.
+   * With bcf_decoys, return a random block of the decoy pool of F, which is
+   * created on the first call. The decoys take the place of the altered
+   * blocks: they only modify x and branch to each other or return, whatever
+   * block branches to them.
    */
-  bool doF(Module &M);
+  bool useDecoys(Function &F);
+  BasicBlock *getDecoy(Function &F);
+  void createDecoys(Function &F);
+
+  // The decoy pool of the function being obfuscated
+  SmallVector<BasicBlock *, 8> decoys;
+
+  /* doF
+   *
+   * Replace the always true predicates of F, the conditions which predicate
+   * is FCMP_TRUE, with opaque predicates. The opaque values are computed once
+   * per function and the blocks in a loop get the cheapest predicate.
+   */
+  bool doF(Function &F);
+
+  // The blocks in a loop, including the ones added by addBogusFlow
+  SmallPtrSet<BasicBlock *, 16> hotBlocks;
 };
 
+// The opaque predicates allowed by bcf_predicates, one bit each
+unsigned getAllowedPredicatesMask();
+
 struct LegacyBogusControlFlow : public FunctionPass, public BogusControlFlow {
   static char ID; // Pass identification
   LegacyBogusControlFlow();
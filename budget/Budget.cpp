@@ -0,0 +1,393 @@
+//===- Budget.cpp - Module-wide obfuscation budget ------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the allocation of the obfuscation budget.
+//
+// The intensities of a function go from nothing to the configured options
+// (flattening, bcf_prob, sub_loop) through a few steps, each step adding the
+// size of the function to the obfuscated instructions. What a step costs is
+// estimated from the TargetTransformInfo size and latency of the function and
+// from the growth the passes were measured to cause:
+// - flattening adds a few instructions per block, a load, a store and the
+//   dispatcher switch to each block execution,
+// - bogus control flow clones each selected block with junk and adds two
+//   opaque predicates, evaluated on each execution of the block,
+// - substitution replaces each binary operator by about 5 instructions, and
+//   again for each loop.
+// The passes are applied to the estimate in pipeline order, as each one
+// works on what the previous ones added.
+// The allocation is the usual greedy heuristic of the multiple-choice
+// knapsack: the step with the best obfuscated instructions to budget ratio
+// is taken first, as long as it fits in both budgets.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Budget.h"
+#include "utils/Utils.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cmath>
+#include <limits>
+#include <queue>
+
+#define DEBUG_TYPE "budget"
+
+using namespace llvm;
+
+// Stats
+STATISTIC(Planned, "Functions given an intensity by the budget");
+STATISTIC(Reduced, "Functions given less than the full intensity");
+
+static cl::opt<int> SizeBudget(
+    "obf_budget_size",
+    cl::desc("Choose the maximum estimated code growth [%] of the module, "
+             "LLVM_OBF_BUDGET_SIZE by default"),
+    cl::value_desc("growth"), cl::init(-1), cl::Optional);
+
+static cl::opt<int> CycleBudget(
+    "obf_budget_cycles",
+    cl::desc("Choose the maximum estimated cycle overhead [%] of the module, "
+             "LLVM_OBF_BUDGET_CYCLES by default"),
+    cl::value_desc("overhead"), cl::init(-1), cl::Optional);
+
+// Growth of the passes, measured with the default options
+static const double FlattenSizePerBlock = 3;
+static const double FlattenSize = 10;
+static const double FlattenCyclesPerBlock = 5;
+static const double BogusSizePerBlock = 55;
+static const double BogusBinaryOpsPerBlock = 30;
+static const double BogusCyclesPerBlock = 10;
+static const double BogusBinaryOpRunsPerBlock = 4;
+static const double DecoySizePerBlock = 10;
+static const double DecoyBinaryOpsPerBlock = 2.5;
+static const double DecoySize = 7;
+static const double SubstitutionGrowth = 4.7;
+
+// Negative if there is no budget
+static int getBudget(const cl::opt<int> &option, const char *var) {
+  if (option.getNumOccurrences() != 0) {
+    return option;
+  }
+
+  const char *value = getenv(var);
+  int budget = -1;
+  if (value == NULL || StringRef(value).getAsInteger(10, budget)) {
+    return -1;
+  }
+  return budget;
+}
+
+// Value of a cl::opt<int> of another pass
+static int getIntOption(StringRef name, int value) {
+  StringMap<cl::Option *> &options = cl::getRegisteredOptions();
+  auto it = options.find(name);
+  if (it != options.end()) {
+    value = static_cast<cl::opt<int> *>(it->second)->getValue();
+  }
+  return value;
+}
+
+#if LLVM_VERSION_MAJOR >= 12
+// InstructionCost::getValue returns an optional or, in the latest versions,
+// the value
+template <typename T> static int64_t getCostValue(const T &value) {
+  return *value;
+}
+LLVM_ATTRIBUTE_UNUSED static int64_t getCostValue(int64_t value) {
+  return value;
+}
+
+static int64_t getCost(const InstructionCost &cost) {
+  return cost.isValid() ? getCostValue(cost.getValue()) : 1;
+}
+#else
+static int64_t getCost(int cost) { return cost; }
+#endif
+
+namespace {
+// What a function weighs, the runs being weighted by the block frequencies
+// and the entry count. The binary operators are the ones substitution
+// replaces.
+struct FunctionCost {
+  double size = 0;
+  double cycles = 0;
+  double blocks = 0;
+  double binaryOps = 0;
+  double blockRuns = 0;
+  double binaryOpRuns = 0;
+};
+
+struct Candidate {
+  Function *F;
+  // Estimated size and cycles added at each intensity of the ladder
+  SmallVector<std::pair<double, double>, 5> costs;
+  double size;
+  unsigned step = 0;
+};
+} // namespace
+
+static FunctionCost estimateFunction(Function &F, double weight,
+                                     const TargetTransformInfo &TTI,
+                                     BlockFrequencyInfo &BFI) {
+  FunctionCost cost;
+  double entry = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+
+  for (BasicBlock &BB : F) {
+    double runs = weight;
+    if (entry > 0) {
+      runs *= BFI.getBlockFreq(&BB).getFrequency() / entry;
+    }
+
+    cost.blocks += 1;
+    cost.blockRuns += runs;
+    for (Instruction &I : BB) {
+      cost.size += getCost(
+          TTI.getInstructionCost(&I, TargetTransformInfo::TCK_CodeSize));
+      cost.cycles += runs * getCost(TTI.getInstructionCost(
+                                &I, TargetTransformInfo::TCK_Latency));
+      switch (I.getOpcode()) {
+      case Instruction::Add:
+      case Instruction::Sub:
+      case Instruction::And:
+      case Instruction::Or:
+      case Instruction::Xor:
+        cost.binaryOps += 1;
+        cost.binaryOpRuns += runs;
+        break;
+      }
+    }
+  }
+
+  return cost;
+}
+
+// Size and cycles the intensity adds to the function
+static std::pair<double, double>
+estimateIntensity(FunctionCost cost, const ObfuscationIntensity &I,
+                  ArrayRef<std::string> passes) {
+  double size = cost.size, cycles = cost.cycles;
+  int decoys = getIntOption("bcf_decoys", 0);
+
+  for (StringRef pass : passes) {
+    if (pass == "flattening" && I.flatten) {
+      // Each block goes through the dispatcher
+      cost.size += FlattenSize + FlattenSizePerBlock * cost.blocks;
+      cost.cycles += FlattenCyclesPerBlock * cost.blockRuns;
+      cost.blocks += 2;
+      cost.blockRuns *= 2;
+    } else if (pass == "bogus" && I.bcfProb > 0) {
+      // The altered clone never runs, the split block and the predicates do
+      double p = I.bcfProb / 100.0;
+      if (decoys > 0) {
+        // Nothing is cloned, the decoy pool is shared by the predicates
+        cost.size += p * DecoySizePerBlock * cost.blocks + DecoySize * decoys;
+        cost.binaryOps += p * DecoyBinaryOpsPerBlock * cost.blocks;
+        cost.blocks += p * 2 * cost.blocks + decoys;
+      } else {
+        cost.size += p * (2 * cost.size + BogusSizePerBlock * cost.blocks);
+        cost.binaryOps +=
+            p * (cost.binaryOps + BogusBinaryOpsPerBlock * cost.blocks);
+        cost.blocks += p * 3 * cost.blocks;
+      }
+      cost.cycles += p * BogusCyclesPerBlock * cost.blockRuns;
+      cost.binaryOpRuns += p * BogusBinaryOpRunsPerBlock * cost.blockRuns;
+      cost.blockRuns += p * cost.blockRuns;
+    } else if (pass == "substitution" && I.subLoop > 0) {
+      double growth = std::pow(1 + SubstitutionGrowth, I.subLoop) - 1;
+      cost.size += growth * cost.binaryOps;
+      cost.cycles += growth * cost.binaryOpRuns;
+      cost.binaryOps += growth * cost.binaryOps;
+      cost.binaryOpRuns += growth * cost.binaryOpRuns;
+    }
+  }
+
+  return {cost.size - size, cost.cycles - cycles};
+}
+
+// An annotation asks for a pass
+static bool isAnnotated(Function &F) {
+  std::string annotation = readAnnotate(&F);
+  for (const char *attr : {"fla", "bcf", "sub"}) {
+    if (annotation.find("no" + std::string(attr)) == std::string::npos &&
+        annotation.find(attr) != std::string::npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+AnalysisKey ObfuscationBudgetAnalysis::Key;
+
+ObfuscationBudgetAnalysis::ObfuscationBudgetAnalysis(
+    ArrayRef<StringRef> pipeline) {
+  for (StringRef pass : pipeline) {
+    if ((pass == "flattening" || pass == "bogus" || pass == "substitution") &&
+        !is_contained(passes, pass)) {
+      passes.push_back(pass.str());
+    }
+  }
+  if (passes.empty()) {
+    passes = {"flattening", "bogus", "substitution"};
+  }
+}
+
+ObfuscationBudget ObfuscationBudgetAnalysis::run(Module &M,
+                                                 ModuleAnalysisManager &AM) {
+  ObfuscationBudget budget;
+  int sizeBudget = getBudget(SizeBudget, "LLVM_OBF_BUDGET_SIZE");
+  int cycleBudget = getBudget(CycleBudget, "LLVM_OBF_BUDGET_CYCLES");
+  if (sizeBudget < 0 && cycleBudget < 0) {
+    return budget;
+  }
+
+  // From nothing to the configured options
+  bool flattening = is_contained(passes, "flattening");
+  int bcfProb =
+      is_contained(passes, "bogus") ? getIntOption("bcf_prob", 30) : 0;
+  int subLoop =
+      is_contained(passes, "substitution") ? getIntOption("sub_loop", 1) : 0;
+  SmallVector<ObfuscationIntensity, 5> ladder;
+  for (ObfuscationIntensity I :
+       {ObfuscationIntensity{false, 0, 0},
+        ObfuscationIntensity{false, 0, std::min(subLoop, 1)},
+        ObfuscationIntensity{false, bcfProb / 2, std::min(subLoop, 1)},
+        ObfuscationIntensity{flattening, bcfProb / 2, std::min(subLoop, 1)},
+        ObfuscationIntensity{flattening, bcfProb, subLoop}}) {
+    const ObfuscationIntensity &last = ladder.empty() ? I : ladder.back();
+    if (ladder.empty() || I.flatten != last.flatten ||
+        I.bcfProb != last.bcfProb || I.subLoop != last.subLoop) {
+      ladder.push_back(I);
+    }
+  }
+
+  FunctionAnalysisManager &FAM =
+      AM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  ProfileSummaryInfo &PSI = AM.getResult<ProfileSummaryAnalysis>(M);
+
+  double totalSize = 0, totalCycles = 0;
+  std::vector<Candidate> candidates;
+  for (Function &F : M) {
+    if (F.isDeclaration() || F.hasAvailableExternallyLinkage() ||
+        !F.hasName()) {
+      continue;
+    }
+
+    double weight = 1;
+    if (PSI.hasProfileSummary()) {
+      auto count = F.getEntryCount();
+      weight = count ? count->getCount() : 0;
+    }
+
+    FunctionCost cost = estimateFunction(
+        F, weight, FAM.getResult<TargetIRAnalysis>(F),
+        FAM.getResult<BlockFrequencyAnalysis>(F));
+    totalSize += cost.size;
+    totalCycles += cost.cycles;
+
+    // Annotations and -obf_percentage may already rule out some passes
+    bool fla = toObfuscate(true, &F, "fla");
+    bool bcf = toObfuscate(true, &F, "bcf");
+    bool sub = toObfuscate(true, &F, "sub");
+
+    Candidate candidate;
+    candidate.F = &F;
+    candidate.size = cost.size;
+    for (const ObfuscationIntensity &I : ladder) {
+      ObfuscationIntensity applied = {I.flatten && fla, bcf ? I.bcfProb : 0,
+                                      sub ? I.subLoop : 0};
+      candidate.costs.push_back(estimateIntensity(cost, applied, passes));
+    }
+    candidates.push_back(std::move(candidate));
+  }
+
+  const double unlimited = std::numeric_limits<double>::infinity();
+  double sizeLeft = sizeBudget < 0 ? unlimited : totalSize * sizeBudget / 100;
+  double cyclesLeft =
+      cycleBudget < 0 ? unlimited : totalCycles * cycleBudget / 100;
+  double sizeScale = sizeBudget < 0 ? 0 : 1 / std::max(sizeLeft, 1.0);
+  double cycleScale = cycleBudget < 0 ? 0 : 1 / std::max(cyclesLeft, 1.0);
+
+  // Obfuscated instructions per share of the budget of the next step
+  auto ratio = [&](const Candidate &c) {
+    const auto &from = c.costs[c.step], &to = c.costs[c.step + 1];
+    double spent = (to.first - from.first) * sizeScale +
+                   (to.second - from.second) * cycleScale;
+    return c.size / std::max(spent, 1e-12);
+  };
+
+  std::priority_queue<std::pair<double, size_t>> steps;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    Candidate &c = candidates[i];
+    if (isAnnotated(*c.F)) {
+      c.step = ladder.size() - 1;
+      sizeLeft -= c.costs[c.step].first;
+      cyclesLeft -= c.costs[c.step].second;
+    } else if (ladder.size() > 1) {
+      steps.push({ratio(c), i});
+    }
+  }
+
+  while (!steps.empty()) {
+    Candidate &c = candidates[steps.top().second];
+    steps.pop();
+
+    double size = c.costs[c.step + 1].first - c.costs[c.step].first;
+    double cycles = c.costs[c.step + 1].second - c.costs[c.step].second;
+    if (size > sizeLeft || cycles > cyclesLeft) {
+      continue;
+    }
+
+    sizeLeft -= size;
+    cyclesLeft -= cycles;
+    if (++c.step + 1 < ladder.size()) {
+      steps.push({ratio(c), size_t(&c - candidates.data())});
+    }
+  }
+
+  for (const Candidate &c : candidates) {
+    LLVM_DEBUG(dbgs() << "budget: " << c.F->getName() << " step " << c.step
+                      << "/" << ladder.size() - 1 << ", size +"
+                      << c.costs[c.step].first << ", cycles +"
+                      << c.costs[c.step].second << "\n");
+    budget.intensities[c.F->getName()] = ladder[c.step];
+    ++Planned;
+    if (c.step + 1 < ladder.size()) {
+      ++Reduced;
+    }
+  }
+
+  return budget;
+}
+
+const ObfuscationIntensity *
+ObfuscationBudget::lookup(const Function &F) const {
+  auto it = intensities.find(F.getName());
+  return it == intensities.end() ? nullptr : &it->second;
+}
+
+bool llvm::isBudgetEnabled() {
+  return getBudget(SizeBudget, "LLVM_OBF_BUDGET_SIZE") >= 0 ||
+         getBudget(CycleBudget, "LLVM_OBF_BUDGET_CYCLES") >= 0;
+}
+
+const ObfuscationIntensity *
+llvm::getPlannedIntensity(Function &F, FunctionAnalysisManager &AM) {
+  const ObfuscationBudget *budget =
+      AM.getResult<ModuleAnalysisManagerFunctionProxy>(F)
+          .getCachedResult<ObfuscationBudgetAnalysis>(*F.getParent());
+  return budget ? budget->lookup(F) : nullptr;
+}
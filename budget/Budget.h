@@ -0,0 +1,94 @@
+//===- Budget.h - Module-wide obfuscation budget --------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains includes and defines for the obfuscation budget
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _BUDGET_INCLUDES_
+#define _BUDGET_INCLUDES_
+
+// LLVM include
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+
+namespace llvm {
+/* ObfuscationIntensity
+ *
+ * What the function passes may do to a function: flatten it or not, the
+ * probability [%] of bogus control flow per block (bcf_prob) and the number
+ * of substitution loops (sub_loop). 0 disables bogus and substitution.
+ */
+struct ObfuscationIntensity {
+  bool flatten;
+  int bcfProb;
+  int subLoop;
+};
+
+/* ObfuscationBudget
+ *
+ * The intensity of each function, allocated so that the estimated code growth
+ * and cycle overhead of the module stay within the budget.
+ */
+class ObfuscationBudget {
+public:
+  // The intensity of F, null for the functions created after the allocation
+  const ObfuscationIntensity *lookup(const Function &F) const;
+
+  // The allocation is made once, before the passes change the functions
+  bool invalidate(Module &M, const PreservedAnalyses &PA,
+                  ModuleAnalysisManager::Invalidator &Inv) {
+    return false;
+  }
+
+  StringMap<ObfuscationIntensity> intensities;
+};
+
+/* ObfuscationBudgetAnalysis
+ *
+ * Estimates the size and the cycles of each function with
+ * TargetTransformInfo, weighted by the block frequencies and the entry count
+ * when there is a profile, and what each intensity would add to them. A
+ * greedy allocator then raises the intensity of the functions with the best
+ * obfuscated instructions to cost ratio first, until the code growth
+ * (LLVM_OBF_BUDGET_SIZE) or the cycle overhead (LLVM_OBF_BUDGET_CYCLES)
+ * budget is spent. Annotated functions get the full intensity whatever the
+ * budget.
+ */
+struct ObfuscationBudgetAnalysis
+    : public AnalysisInfoMixin<ObfuscationBudgetAnalysis> {
+  using Result = ObfuscationBudget;
+
+  // pipeline are the function passes of the extension points, flattening,
+  // bogus and substitution if empty
+  ObfuscationBudgetAnalysis(ArrayRef<StringRef> pipeline = {});
+  Result run(Module &M, ModuleAnalysisManager &AM);
+
+  static AnalysisKey Key;
+
+  // The passes the budget applies to, in pipeline order
+  SmallVector<std::string, 3> passes;
+};
+
+// Whether a budget is set by LLVM_OBF_BUDGET_SIZE, LLVM_OBF_BUDGET_CYCLES or
+// the matching options
+bool isBudgetEnabled();
+
+// The intensity allocated to F, null if no allocation was made for its module
+// (the budget is disabled or nothing required the analysis) or for F
+const ObfuscationIntensity *getPlannedIntensity(Function &F,
+                                                FunctionAnalysisManager &AM);
+} // namespace llvm
+
+#endif
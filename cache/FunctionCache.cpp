@@ -0,0 +1,565 @@
+//===- FunctionCache.cpp - On-disk cache of obfuscated functions ----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the function cache.
+//
+// The key of a function is the SHA-256 of the LLVM version, of the version of
+// the passes output, of the pass list, of the passes options, of the seed
+// derived for the function and of the function extracted alone in a module.
+// That module declares everything the function refers to, so its bitcode
+// covers the body, the attributes, the non-debug metadata and the types and
+// names of the referenced globals.
+//
+// The value is the obfuscated function extracted the same way, along with the
+// globals created by the passes. On a hit it is parsed in the function context
+// and its body is moved into the function, globals being matched by name.
+//
+// Functions with debug info are not cached.
+//
+//===----------------------------------------------------------------------===//
+
+#include "FunctionCache.h"
+#include "bogus/BogusControlFlow.h"
+#include "budget/Budget.h"
+#include "flattening/Flattening.h"
+#include "utils/CryptoUtils.h"
+#include "utils/Utils.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <memory>
+#include <mutex>
+
+#define DEBUG_TYPE "cache"
+
+using namespace llvm;
+
+// Stats
+STATISTIC(Hits, "Functions found in the cache");
+STATISTIC(Misses, "Functions obfuscated and stored in the cache");
+STATISTIC(Uncached, "Functions that cannot be cached");
+
+// Options of the passes that change their output, all are cl::opt<int>
+static const char *const KeyOptions[] = {
+    "bcf_prob",  "bcf_loop",       "bcf_decoys",        "sub_loop",
+    "split_num", "fla_min_states", "fla_chain_branches"};
+
+// Version of the output of the passes, to bump whenever a pass changes what
+// it generates so that the stale entries are not hit
+static const unsigned CacheFormatVersion = 1;
+
+// Cache files share the ThinLTO prefix, which pruneCache looks for
+static const char *const CacheFilePrefix = "llvmcache-obf-";
+
+StringRef llvm::getCacheDir() {
+  static const std::string dir = [] {
+    const char *value = getenv("LLVM_OBF_CACHE_DIR");
+    return value == NULL ? std::string() : std::string(value);
+  }();
+  return dir;
+}
+
+// Called once per process, creates the directory and prunes it. The policy
+// comes from LLVM_OBF_CACHE_POLICY in the ThinLTO syntax
+// ("prune_interval=1h:cache_size=10%" for instance)
+static void prepareCacheDir() {
+  if (std::error_code EC = sys::fs::create_directories(getCacheDir())) {
+    errs() << "LLVM_OBF_CACHE_DIR: " << EC.message() << "\n";
+    return;
+  }
+
+  CachePruningPolicy policy;
+  const char *value = getenv("LLVM_OBF_CACHE_POLICY");
+  if (value != NULL) {
+    Expected<CachePruningPolicy> parsed = parseCachePruningPolicy(value);
+    if (!parsed) {
+      errs() << "LLVM_OBF_CACHE_POLICY: " << toString(parsed.takeError())
+             << "\n";
+      return;
+    }
+    policy = *parsed;
+  }
+
+  pruneCache(getCacheDir(), policy);
+}
+
+// The generator installed while a function goes through the pipeline,
+// reseeded for every function
+static CryptoUtils &functionCryptoUtils() {
+  static thread_local std::unique_ptr<CryptoUtils> utils;
+  if (!utils) {
+    utils = std::make_unique<CryptoUtils>();
+  }
+  return *utils;
+}
+
+// Struct types of a module parsed in a context which already has types of the
+// same names are renamed ("struct.foo.0"), map them back to the original ones.
+// The key covers the definition of the types so they have the same layout.
+class CacheTypeRemapper : public ValueMapTypeRemapper {
+public:
+  CacheTypeRemapper(LLVMContext &ctx) : ctx(ctx) {}
+  Type *remapType(Type *SrcTy) override;
+
+private:
+  LLVMContext &ctx;
+  DenseMap<Type *, Type *> mapped;
+};
+
+Type *CacheTypeRemapper::remapType(Type *SrcTy) {
+  auto it = mapped.find(SrcTy);
+  if (it != mapped.end()) {
+    return it->second;
+  }
+
+  Type *result = SrcTy;
+  StructType *ST = dyn_cast<StructType>(SrcTy);
+
+  if (ST && !ST->isLiteral()) {
+    std::pair<StringRef, StringRef> name = ST->getName().rsplit('.');
+    if (!name.second.empty() &&
+        all_of(name.second, [](char c) { return isDigit(c); })) {
+      if (StructType *orig = StructType::getTypeByName(ctx, name.first)) {
+        result = orig;
+      }
+    }
+  } else {
+    SmallVector<Type *, 4> subtypes;
+    bool changed = false;
+    for (Type *sub : SrcTy->subtypes()) {
+      subtypes.push_back(remapType(sub));
+      changed |= subtypes.back() != sub;
+    }
+
+    if (changed) {
+      switch (SrcTy->getTypeID()) {
+      case Type::ArrayTyID:
+        result = ArrayType::get(subtypes[0], SrcTy->getArrayNumElements());
+        break;
+      case Type::FixedVectorTyID:
+      case Type::ScalableVectorTyID:
+        result = VectorType::get(subtypes[0],
+                                 cast<VectorType>(SrcTy)->getElementCount());
+        break;
+#if LLVM_VERSION_MAJOR < 17
+      case Type::PointerTyID:
+        result = PointerType::get(subtypes[0], SrcTy->getPointerAddressSpace());
+        break;
+#endif
+      case Type::FunctionTyID:
+        result = FunctionType::get(subtypes[0],
+                                   ArrayRef<Type *>(subtypes).slice(1),
+                                   cast<FunctionType>(SrcTy)->isVarArg());
+        break;
+      case Type::StructTyID:
+        result = StructType::get(ctx, subtypes, ST->isPacked());
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  mapped[SrcTy] = result;
+  return result;
+}
+
+// CloneFunctionInto adds an empty llvm.dbg.cu to the destination module, which
+// makes the bitcode reader warn about invalid debug info
+static void dropEmptyCompileUnits(Module &M) {
+  NamedMDNode *CUs = M.getNamedMetadata("llvm.dbg.cu");
+  if (CUs && CUs->getNumOperands() == 0) {
+    M.eraseNamedMetadata(CUs);
+  }
+}
+
+// Collect the globals F refers to, including the ones only referred to by the
+// initializers of the globals in created. Fails on blockaddress, which would
+// need the blocks of another function, and on the unnamed globals that are not
+// in created, which cannot be looked up on a hit.
+static bool collectGlobals(Function &F,
+                           const SmallSetVector<GlobalValue *, 4> &created,
+                           SetVector<GlobalValue *> &globals) {
+  SmallVector<Value *, 16> worklist;
+  SmallPtrSet<Value *, 16> visited;
+
+  // Personality, prefix and prologue
+  for (Value *op : F.operands()) {
+    worklist.push_back(op);
+  }
+  for (Instruction &I : instructions(F)) {
+    for (Value *op : I.operands()) {
+      if (isa<Constant>(op)) {
+        worklist.push_back(op);
+      }
+    }
+  }
+
+  while (!worklist.empty()) {
+    Value *V = worklist.pop_back_val();
+    if (!visited.insert(V).second || V == &F) {
+      continue;
+    }
+
+    if (isa<BlockAddress>(V)) {
+      return false;
+    }
+
+    if (GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+      if (!GV->hasName() && !created.count(GV)) {
+        return false;
+      }
+      globals.insert(GV);
+
+      GlobalVariable *GVar = dyn_cast<GlobalVariable>(GV);
+      if (GVar && created.count(GVar) && GVar->hasInitializer()) {
+        worklist.push_back(GVar->getInitializer());
+      }
+    } else if (Constant *C = dyn_cast<Constant>(V)) {
+      for (Value *op : C->operands()) {
+        worklist.push_back(op);
+      }
+    }
+  }
+
+  return true;
+}
+
+// Copy F alone in a new module of the same context. The globals in created are
+// defined first and in order, so that a hit creates them with the same names,
+// the other ones are declared.
+static std::unique_ptr<Module>
+extractFunction(Function &F, const SmallSetVector<GlobalValue *, 4> &created) {
+  Module &M = *F.getParent();
+  SetVector<GlobalValue *> globals;
+
+  if (!collectGlobals(F, created, globals)) {
+    return nullptr;
+  }
+
+  std::unique_ptr<Module> E = std::make_unique<Module>("", F.getContext());
+  E->setDataLayout(M.getDataLayout());
+  E->setTargetTriple(M.getTargetTriple());
+
+  ValueToValueMapTy VMap;
+  SmallVector<std::pair<GlobalVariable *, GlobalVariable *>, 4> definitions;
+
+  for (GlobalValue *GV : created) {
+    GlobalVariable *GVar = dyn_cast<GlobalVariable>(GV);
+    if (!GVar || !globals.count(GVar)) {
+      continue;
+    }
+
+    GlobalVariable *def = new GlobalVariable(
+        *E, GVar->getValueType(), GVar->isConstant(), GVar->getLinkage(),
+        nullptr, GVar->getName(), nullptr, GVar->getThreadLocalMode(),
+        GVar->getAddressSpace());
+    def->copyAttributesFrom(GVar);
+    definitions.push_back({GVar, def});
+    VMap[GV] = def;
+  }
+
+  for (GlobalValue *GV : globals) {
+    Type *type = GV->getValueType();
+    GlobalVariable *GVar = dyn_cast<GlobalVariable>(GV);
+
+    if (VMap.count(GV)) {
+      continue;
+    } else if (type->isFunctionTy()) {
+      Function *decl = Function::Create(
+          cast<FunctionType>(type), GlobalValue::ExternalLinkage,
+          GV->getAddressSpace(), GV->getName(), E.get());
+      if (Function *Fn = dyn_cast<Function>(GV)) {
+        decl->setAttributes(Fn->getAttributes());
+        decl->setCallingConv(Fn->getCallingConv());
+      }
+      VMap[GV] = decl;
+    } else {
+      VMap[GV] = new GlobalVariable(
+          *E, type, GVar && GVar->isConstant(), GlobalValue::ExternalLinkage,
+          nullptr, GV->getName(), nullptr, GV->getThreadLocalMode(),
+          GV->getAddressSpace());
+    }
+  }
+
+  Function *CF = Function::Create(F.getFunctionType(), F.getLinkage(),
+                                  F.getAddressSpace(), F.getName(), E.get());
+  auto CArg = CF->arg_begin();
+  for (Argument &Arg : F.args()) {
+    VMap[&Arg] = &*CArg++;
+  }
+
+  SmallVector<ReturnInst *, 8> returns;
+  CloneFunctionInto(CF, &F, VMap,
+#if LLVM_VERSION_MAJOR < 13
+                    true,
+#else
+                    CloneFunctionChangeType::DifferentModule,
+#endif
+                    returns);
+  dropEmptyCompileUnits(*E);
+
+  for (auto &def : definitions) {
+    if (def.first->hasInitializer()) {
+      def.second->setInitializer(MapValue(def.first->getInitializer(), VMap));
+    }
+  }
+
+  return E;
+}
+
+static std::string computeKey(Function &F, Module &input, StringRef passes,
+                              const ObfuscationIntensity *intensity,
+                              StringRef seed) {
+  SmallVector<char, 0> data;
+  raw_svector_ostream os(data);
+  StringMap<cl::Option *> &options = cl::getRegisteredOptions();
+
+  // The output also depends on the build of LLVM and of the plugin
+  os << "llvm=" << LLVM_VERSION_STRING << '\0';
+  os << "format=" << CacheFormatVersion << '\0';
+  os << passes << '\0';
+  for (const char *name : KeyOptions) {
+    auto it = options.find(name);
+    if (it != options.end()) {
+      os << name << '=' << static_cast<cl::opt<int> *>(it->second)->getValue()
+         << '\0';
+    }
+  }
+  os << "bcf_predicates=" << getAllowedPredicatesMask() << '\0';
+  os << "fla_dense=" << isDenseFlattening() << '\0';
+  os << "percentage=" << getObfuscationPercentage() << '\0';
+  os << "multi_round=" << isMultiRound() << '\0';
+  // The annotations of F are not part of the extracted module
+  os << "annotate=" << readAnnotate(&F) << '\0';
+  if (intensity) {
+    os << "budget=" << intensity->flatten << ',' << intensity->bcfProb << ','
+       << intensity->subLoop << '\0';
+  }
+  os << seed << '\0';
+  WriteBitcodeToFile(input, os);
+
+  unsigned char hash[32];
+  cryptoutils->sha256(data.data(), data.size(), hash);
+
+  return toHex(ArrayRef<uint8_t>(hash, 32));
+}
+
+// Write to a temporary file first, so that concurrent builds sharing the
+// cache never read a partial file
+static void storeModule(Module &E, StringRef path) {
+  SmallString<128> tmp;
+  int fd;
+
+  if (sys::fs::createUniqueFile(path + ".tmp-%%%%%%", fd, tmp)) {
+    return;
+  }
+
+  raw_fd_ostream os(fd, /* shouldClose */ true);
+  WriteBitcodeToFile(E, os);
+  os.close();
+
+  if (os.has_error()) {
+    os.clear_error();
+    sys::fs::remove(tmp);
+  } else if (sys::fs::rename(tmp, path)) {
+    sys::fs::remove(tmp);
+  }
+}
+
+// Replace the body of F with the cached one. Leaves F untouched and returns
+// false if the cached module does not fit in F's module.
+static bool loadFunction(Function &F, MemoryBufferRef buffer) {
+  Module &M = *F.getParent();
+  LLVMContext &ctx = F.getContext();
+
+  Expected<std::unique_ptr<Module>> E = parseBitcodeFile(buffer, ctx);
+  if (!E) {
+    consumeError(E.takeError());
+    return false;
+  }
+
+  Function *CF = (*E)->getFunction(F.getName());
+  CacheTypeRemapper types(ctx);
+  if (!CF || CF->isDeclaration() ||
+      types.remapType(CF->getFunctionType()) != F.getFunctionType()) {
+    return false;
+  }
+
+  ValueToValueMapTy VMap;
+  SmallVector<GlobalVariable *, 4> created;
+
+  for (GlobalValue &GV : (*E)->global_values()) {
+    if (&GV == CF) {
+      continue;
+    }
+
+    if (!GV.isDeclaration()) {
+      GlobalVariable *GVar = dyn_cast<GlobalVariable>(&GV);
+      if (!GVar) {
+        return false;
+      }
+      created.push_back(GVar);
+      continue;
+    }
+
+    GlobalValue *orig = M.getNamedValue(GV.getName());
+    if (!orig || orig->getType() != types.remapType(GV.getType()) ||
+        orig->getValueType() != types.remapType(GV.getValueType())) {
+      return false;
+    }
+    VMap[&GV] = orig;
+  }
+
+  // From here on the cached body is used
+  SmallVector<std::pair<GlobalVariable *, GlobalVariable *>, 4> definitions;
+  for (GlobalVariable *GVar : created) {
+    GlobalVariable *def = new GlobalVariable(
+        M, types.remapType(GVar->getValueType()), GVar->isConstant(),
+        GVar->getLinkage(), nullptr, GVar->getName(), nullptr,
+        GVar->getThreadLocalMode(), GVar->getAddressSpace());
+    def->copyAttributesFrom(GVar);
+    definitions.push_back({GVar, def});
+    VMap[GVar] = def;
+  }
+
+  VMap[CF] = &F;
+  auto Arg = F.arg_begin();
+  for (Argument &CArg : CF->args()) {
+    VMap[&CArg] = &*Arg++;
+  }
+
+  for (BasicBlock &BB : F) {
+    BB.dropAllReferences();
+  }
+  while (!F.empty()) {
+    F.begin()->eraseFromParent();
+  }
+
+  // Move the cached body rather than cloning it, as the IR linker does, and
+  // remap it in place
+#if LLVM_VERSION_MAJOR >= 16
+  F.splice(F.end(), CF);
+#else
+  F.getBasicBlockList().splice(F.end(), CF->getBasicBlockList());
+#endif
+  RemapFunction(F, VMap, RF_IgnoreMissingLocals, &types);
+
+  // The parameter attributes of CF may carry renamed types (byval, sret...),
+  // keep the ones of F which the passes do not change
+  AttributeList attrs = F.getAttributes();
+  SmallVector<AttributeSet, 8> params;
+  for (unsigned i = 0; i < F.arg_size(); ++i) {
+    params.push_back(attrs.getParamAttrs(i));
+  }
+  F.setAttributes(AttributeList::get(ctx, CF->getAttributes().getFnAttrs(),
+                                     attrs.getRetAttrs(), params));
+
+  for (auto &def : definitions) {
+    if (def.first->hasInitializer()) {
+      def.second->setInitializer(
+          MapValue(def.first->getInitializer(), VMap, RF_None, &types));
+    }
+  }
+
+  return true;
+}
+
+static bool isCacheable(Function &F) {
+  if (F.getSubprogram() != nullptr || !F.hasName()) {
+    return false;
+  }
+
+  for (BasicBlock &BB : F) {
+    if (BB.hasAddressTaken()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+FunctionCachePass::FunctionCachePass(std::string passes,
+                                     FunctionPassManager FPM)
+    : passes(std::move(passes)), FPM(std::move(FPM)) {}
+
+PreservedAnalyses FunctionCachePass::run(Function &F,
+                                         FunctionAnalysisManager &AM) {
+  static std::once_flag prepared;
+  std::call_once(prepared, prepareCacheDir);
+
+  if (F.isDeclaration()) {
+    return PreservedAnalyses::all();
+  }
+
+  // Each function gets its own stream, a hit then does not depend on what
+  // was obfuscated before
+  std::string seed = cryptoutils->derive_seed(passes + ":" + F.getName().str());
+  CryptoUtils &utils = functionCryptoUtils();
+  utils.prng_seed(seed);
+  CryptoUtilsScope scope(utils);
+
+  Module &M = *F.getParent();
+  SmallSetVector<GlobalValue *, 4> created;
+  std::unique_ptr<Module> input;
+
+  if (isCacheable(F)) {
+    input = extractFunction(F, created);
+  }
+  if (!input) {
+    ++Uncached;
+    return FPM.run(F, AM);
+  }
+
+  SmallString<128> path(getCacheDir());
+  sys::path::append(path, CacheFilePrefix +
+                              computeKey(F, *input, passes,
+                                         getPlannedIntensity(F, AM), seed));
+  input.reset();
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFile(path);
+  if (buffer && loadFunction(F, (*buffer)->getMemBufferRef())) {
+    ++Hits;
+    return PreservedAnalyses::none();
+  }
+
+  // The passes add their globals at the end of the list
+  GlobalVariable *last =
+      M.global_empty() ? nullptr : &*std::prev(M.global_end());
+  PreservedAnalyses PA = FPM.run(F, AM);
+
+  auto GV = last ? std::next(last->getIterator()) : M.global_begin();
+  for (; GV != M.global_end(); ++GV) {
+    created.insert(&*GV);
+  }
+
+  if (std::unique_ptr<Module> output = extractFunction(F, created)) {
+    storeModule(*output, path);
+  }
+  ++Misses;
+
+  return PA;
+}
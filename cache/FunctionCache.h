@@ -0,0 +1,45 @@
+//===- FunctionCache.h - On-disk cache of obfuscated functions ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains includes and defines for the function cache
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _FUNCTION_CACHE_INCLUDES_
+#define _FUNCTION_CACHE_INCLUDES_
+
+// LLVM include
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+#include <string>
+
+namespace llvm {
+/* FunctionCachePass
+ *
+ * Runs a function pipeline through the cache directory given by the
+ * environment variable LLVM_OBF_CACHE_DIR, like the ThinLTO cache. Functions
+ * are keyed by their IR, the pass list, the passes options and a seed derived
+ * for each function, so that a hit gives the same result as running the
+ * pipeline.
+ */
+struct FunctionCachePass : public PassInfoMixin<FunctionCachePass> {
+  FunctionCachePass(std::string passes, FunctionPassManager FPM);
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
+
+  std::string passes;
+  FunctionPassManager FPM;
+};
+
+// Returns the cache directory, empty if the cache is disabled
+StringRef getCacheDir();
+} // namespace llvm
+
+#endif
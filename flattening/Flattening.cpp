@@ -12,12 +12,17 @@
 //===----------------------------------------------------------------------===//
 
 #include "Flattening.h"
+#include "budget/Budget.h"
 #include "utils/Utils.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Analysis/AssumptionCache.h"
 #include "llvm/Analysis/LazyValueInfo.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils.h"
 #include "llvm/Transforms/Utils/LowerSwitch.h"
@@ -30,9 +35,41 @@ using namespace llvm;
 
 // Stats
 STATISTIC(Flattened, "Functions flattened");
+STATISTIC(Skipped, "Functions already flattened, skipped");
+STATISTIC(Coalesced, "Blocks coalesced into the state of their predecessor");
 
 namespace llvm {
 
+static cl::opt<bool> DenseStates(
+    "fla_dense",
+    cl::desc("Choose dense dispatcher states for the -fla pass, which lower "
+             "to a jump table, LLVM_OBF_FLA_DENSE by default"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<int> ChainMinStates(
+    "fla_min_states",
+    cl::desc("Choose the minimum number of dispatcher states the -fla pass "
+             "keeps when coalescing straight-line chains of blocks into one "
+             "state, -1 to not coalesce"),
+    cl::value_desc("number of states"), cl::init(-1), cl::Optional);
+
+static cl::opt<int> ChainBranches(
+    "fla_chain_branches",
+    cl::desc("Choose the probability [%] each jump inside a coalesced chain "
+             "gets a branch to the dispatcher that is never taken"),
+    cl::value_desc("probability rate"), cl::init(0), cl::Optional);
+
+bool isDenseFlattening() {
+  if (DenseStates.getNumOccurrences() == 0) {
+    static const bool fromEnv = [] {
+      const char *value = getenv("LLVM_OBF_FLA_DENSE");
+      return value != NULL && StringRef(value) == "y";
+    }();
+    return fromEnv;
+  }
+  return DenseStates;
+}
+
 bool Flattening::flatten(Function *f) {
   std::vector<BasicBlock *> origBB;
   BasicBlock *loopEntry;
@@ -71,6 +108,12 @@ bool Flattening::flatten(Function *f) {
   // Remove first BB
   origBB.erase(origBB.begin());
 
+  // The dispatcher construction shows up in -ftime-trace, up to fixStack
+  bool trace = timeTraceProfilerEnabled();
+  if (trace) {
+    timeTraceProfilerBegin("FlatteningDispatcher", f->getName());
+  }
+
   // Get a pointer on the first BB
   Function::iterator tmp = f->begin(); //++tmp;
   BasicBlock *insert = &*tmp;
@@ -93,16 +136,77 @@ bool Flattening::flatten(Function *f) {
     origBB.insert(origBB.begin(), tmpBB);
   }
 
+  // Blocks reachable from the entry, while it still jumps to them
+  SmallPtrSet<BasicBlock *, 16> reachable;
+  if (ChainMinStates >= 0) {
+    for (BasicBlock *bb : depth_first(insert)) {
+      reachable.insert(bb);
+    }
+  }
+
   // Remove jump
   insert->getTerminator()->eraseFromParent();
 
+  // A block jumping to a block it is the only predecessor of keeps its jump,
+  // the successor is linked and gets no case: a chain of blocks, as left by
+  // split-basic-blocks, goes through the dispatcher once. Chains are
+  // coalesced until -fla_min_states states are left. Only the reachable
+  // blocks are linked, a dead cycle would have no first block.
+  SmallPtrSet<BasicBlock *, 16> linked;
+  if (ChainMinStates >= 0) {
+    size_t states = origBB.size();
+    for (BasicBlock *bb : origBB) {
+      if (states <= (size_t)std::max(ChainMinStates.getValue(), 1)) {
+        break;
+      }
+      if (!reachable.count(bb)) {
+        continue;
+      }
+      BranchInst *jump = dyn_cast<BranchInst>(bb->getTerminator());
+      if (jump == NULL || jump->isConditional()) {
+        continue;
+      }
+      BasicBlock *succ = jump->getSuccessor(0);
+      if (succ != bb && succ->getSinglePredecessor() == bb) {
+        linked.insert(succ);
+        --states;
+      }
+    }
+    Coalesced += linked.size();
+  }
+
+  // The case of the i-th block is scramble32(i), a sparse value the switch
+  // lowers to a tree of comparisons, or with dense states perm[i], perm being
+  // a random permutation of [0, n). switchVar then holds the case xored with
+  // a mask below the next power of two, so that the cases stay dense whether
+  // the mask is folded into them or not: the switch lowers to a bounds check
+  // and a jump table.
+  Type *stateType = Type::getInt32Ty(f->getContext());
+  bool dense = isDenseFlattening();
+  SmallVector<uint32_t, 0> perm;
+  uint32_t mask = 0;
+  if (dense) {
+    for (uint32_t i = 0; i < origBB.size() - linked.size(); ++i) {
+      perm.push_back(i);
+    }
+    for (uint32_t i = perm.size() - 1; i > 0; --i) {
+      std::swap(perm[i], perm[llvm::cryptoutils->get_range(i + 1)]);
+    }
+    mask = llvm::cryptoutils->get_range(PowerOf2Ceil(perm.size()));
+  }
+  auto caseValue = [&](unsigned index) {
+    uint32_t value = dense ? perm[index]
+                           : llvm::cryptoutils->scramble32(index,
+                                                           scrambling_key);
+    return cast<ConstantInt>(ConstantInt::get(stateType, value));
+  };
+  auto encode = [&](ConstantInt *numCase) {
+    return ConstantInt::get(stateType, numCase->getZExtValue() ^ mask);
+  };
+
   // Create switch variable and set as it
-  switchVar =
-      new AllocaInst(Type::getInt32Ty(f->getContext()), 0, "switchVar", insert);
-  new StoreInst(
-      ConstantInt::get(Type::getInt32Ty(f->getContext()),
-                       llvm::cryptoutils->scramble32(0, scrambling_key)),
-      switchVar, insert);
+  switchVar = new AllocaInst(stateType, 0, "switchVar", insert);
+  new StoreInst(encode(caseValue(0)), switchVar, insert);
   // Create main loop
   loopEntry = BasicBlock::Create(f->getContext(), "loopEntry", f, insert);
   loopEnd = BasicBlock::Create(f->getContext(), "loopEnd", f, insert);
@@ -122,13 +226,24 @@ bool Flattening::flatten(Function *f) {
   BranchInst::Create(loopEnd, swDefault);
 
   // Create switch instruction itself and set condition
+  Value *state = load;
+  if (mask != 0) {
+    state = BinaryOperator::CreateXor(load, ConstantInt::get(stateType, mask),
+                                      "state", loopEntry);
+  }
   switchI = SwitchInst::Create(&*f->begin(), swDefault, 0, loopEntry);
-  switchI->setCondition(load);
+  switchI->setCondition(state);
 
   // Remove branch jump from 1st BB and make a jump to the while
   f->begin()->getTerminator()->eraseFromParent();
 
   BranchInst::Create(loopEntry, &*f->begin());
+
+  // The dispatcher hides the flow from fixStack, which needs it to tell the
+  // slots that can share an alloca
+  BlockFlow flow;
+  flow[&*f->begin()].push_back(origBB[0]);
+
   // Put all BB in the switch
   for (std::vector<BasicBlock *>::iterator b = origBB.begin();
        b != origBB.end(); ++b) {
@@ -138,10 +253,12 @@ bool Flattening::flatten(Function *f) {
     // Move the BB inside the switch (only visual, no code logic)
     i->moveBefore(loopEnd);
 
+    if (linked.count(i)) {
+      continue;
+    }
+
     // Add case to switch
-    numCase = cast<ConstantInt>(ConstantInt::get(
-        switchI->getCondition()->getType(),
-        llvm::cryptoutils->scramble32(switchI->getNumCases(), scrambling_key)));
+    numCase = caseValue(switchI->getNumCases());
     switchI->addCase(numCase, i);
   }
   // Recalculate switchVar
@@ -154,6 +271,31 @@ bool Flattening::flatten(Function *f) {
     if (i->getTerminator()->getNumSuccessors() == 0) {
       continue;
     }
+    flow[i].append(succ_begin(i), succ_end(i));
+
+    // Jump inside a chain, switchVar still holds the case of its first block
+    if (i->getTerminator()->getNumSuccessors() == 1 &&
+        linked.count(i->getTerminator()->getSuccessor(0))) {
+      if ((int)llvm::cryptoutils->get_range(100) < ChainBranches) {
+        BasicBlock *head = i;
+        while (head && linked.count(head)) {
+          head = head->getSinglePredecessor();
+          if (head == i) {
+            head = nullptr;
+          }
+        }
+        ConstantInt *headCase = head ? switchI->findCaseDest(head) : nullptr;
+        if (headCase) {
+          BranchInst *jump = cast<BranchInst>(i->getTerminator());
+          LoadInst *current = new LoadInst(stateType, switchVar, "", jump);
+          ICmpInst *same = new ICmpInst(jump, ICmpInst::ICMP_EQ, current,
+                                        encode(headCase));
+          BranchInst::Create(jump->getSuccessor(0), loopEnd, same, jump);
+          jump->eraseFromParent();
+        }
+      }
+      continue;
+    }
 
     // If it's a non-conditional jump
     if (i->getTerminator()->getNumSuccessors() == 1) {
@@ -166,14 +308,11 @@ bool Flattening::flatten(Function *f) {
 
       // If next case == default case (switchDefault)
       if (numCase == NULL) {
-        numCase = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-                             llvm::cryptoutils->scramble32(
-                                 switchI->getNumCases() - 1, scrambling_key)));
+        numCase = caseValue(switchI->getNumCases() - 1);
       }
 
       // Update switchVar and jump to the end of loop
-      new StoreInst(numCase, load->getPointerOperand(), i);
+      new StoreInst(encode(numCase), load->getPointerOperand(), i);
       BranchInst::Create(loopEnd, i);
       continue;
     }
@@ -188,24 +327,18 @@ bool Flattening::flatten(Function *f) {
 
       // Check if next case == default case (switchDefault)
       if (numCaseTrue == NULL) {
-        numCaseTrue = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-                             llvm::cryptoutils->scramble32(
-                                 switchI->getNumCases() - 1, scrambling_key)));
+        numCaseTrue = caseValue(switchI->getNumCases() - 1);
       }
 
       if (numCaseFalse == NULL) {
-        numCaseFalse = cast<ConstantInt>(
-            ConstantInt::get(switchI->getCondition()->getType(),
-                             llvm::cryptoutils->scramble32(
-                                 switchI->getNumCases() - 1, scrambling_key)));
+        numCaseFalse = caseValue(switchI->getNumCases() - 1);
       }
 
       // Create a SelectInst
       BranchInst *br = cast<BranchInst>(i->getTerminator());
-      SelectInst *sel =
-          SelectInst::Create(br->getCondition(), numCaseTrue, numCaseFalse, "",
-                             i->getTerminator());
+      SelectInst *sel = SelectInst::Create(
+          br->getCondition(), encode(numCaseTrue), encode(numCaseFalse), "",
+          i->getTerminator());
 
       // Erase terminator
       i->getTerminator()->eraseFromParent();
@@ -217,16 +350,27 @@ bool Flattening::flatten(Function *f) {
     }
   }
 
-  fixStack(f);
+  if (trace) {
+    timeTraceProfilerEnd();
+  }
+
+  fixStack(f, &flow);
 
   return true;
 }
 
 bool Flattening::runFlattening(Function &F) {
   Function *tmp = &F;
+  if (isObfuscated(tmp, "fla")) {
+    ++Skipped;
+    return false;
+  }
+
   // Do we obfuscate
   if (toObfuscate(true, tmp, "fla")) {
+    ValueNamesScope names(F.getContext());
     if (flatten(tmp)) {
+      markObfuscated(tmp, "fla");
       ++Flattened;
       return true;
     }
@@ -254,7 +398,19 @@ PreservedAnalyses FlatteningObfuscatorPass::run(Function &F,
 
   PreservedAnalyses analysis = PreservedAnalyses::all();
 
-  analysis.intersect(LowerSwitchPass().run(F, AM));
+  const ObfuscationIntensity *intensity = getPlannedIntensity(F, AM);
+  if (intensity && !intensity->flatten) {
+    return analysis;
+  }
+  if (isObfuscated(&F, "fla")) {
+    ++Skipped;
+    return analysis;
+  }
+
+  {
+    TimeTraceScope scope("LowerSwitch", F.getName());
+    analysis.intersect(LowerSwitchPass().run(F, AM));
+  }
 
   analysis.intersect(runFlattening(F) ? PreservedAnalyses::none()
                                       : PreservedAnalyses::all());
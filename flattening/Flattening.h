@@ -34,6 +34,10 @@ struct Flattening {
   bool flatten(Function *f);
 };
 
+// Whether the dispatcher states are dense, from -fla_dense or
+// LLVM_OBF_FLA_DENSE
+bool isDenseFlattening();
+
 struct FlatteningObfuscatorPass
     : public PassInfoMixin<FlatteningObfuscatorPass>,
       public Flattening {
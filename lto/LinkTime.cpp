@@ -0,0 +1,105 @@
+//===- LinkTime.cpp - Link-time obfuscation stage -------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the deferral of the linkonce_odr functions to the
+// link-time stage.
+//
+//===----------------------------------------------------------------------===//
+
+#include "LinkTime.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+
+#define DEBUG_TYPE "lto"
+
+using namespace llvm;
+
+// Stats
+STATISTIC(Deferred, "Functions deferred to link time");
+STATISTIC(Resumed, "Deferred functions obfuscated at link time");
+
+bool llvm::reachesLinkTime(const Module &M, const LTOPhase &phase) {
+  bool linkTime = false;
+  if (phase.known) {
+    linkTime = phase.preLink;
+  } else if (auto *thinLTO = mdconst::extract_or_null<ConstantInt>(
+                 M.getModuleFlag("ThinLTO"))) {
+    linkTime = thinLTO->isZero();
+  }
+
+  static std::atomic<bool> warned(false);
+  if (!linkTime && !phase.postLink && !warned.exchange(true)) {
+    errs() << "LLVM_OBF_LTO_PASSES: no link-time stage after this "
+              "compilation, its passes run now\n";
+  }
+  return linkTime;
+}
+
+LTODeferPass::LTODeferPass(FunctionPassManager FPM,
+                           std::shared_ptr<const LTOPhase> phase)
+    : FPM(std::move(FPM)), phase(std::move(phase)) {}
+
+PreservedAnalyses LTODeferPass::run(Function &F, FunctionAnalysisManager &AM) {
+  // Never emitted, the defining translation unit obfuscates it
+  if (F.isDeclaration() || F.hasAvailableExternallyLinkage()) {
+    return PreservedAnalyses::all();
+  }
+
+  if (F.hasFnAttribute(LTODeferredAttr)) {
+    return PreservedAnalyses::all();
+  }
+
+  if (!reachesLinkTime(*F.getParent(), *phase)) {
+    return FPM.run(F, AM);
+  }
+
+  if (F.hasLinkOnceODRLinkage()) {
+    F.addFnAttr(LTODeferredAttr);
+    ++Deferred;
+    return PreservedAnalyses::all();
+  }
+
+  return FPM.run(F, AM);
+}
+
+LTODeferModulePass::LTODeferModulePass(ModulePassManager MPM,
+                                       std::shared_ptr<const LTOPhase> phase)
+    : MPM(std::move(MPM)), phase(std::move(phase)) {}
+
+PreservedAnalyses LTODeferModulePass::run(Module &M,
+                                          ModuleAnalysisManager &AM) {
+  // After the link, the stage itself runs them
+  if (phase->postLink || reachesLinkTime(M, *phase)) {
+    return PreservedAnalyses::all();
+  }
+  return MPM.run(M, AM);
+}
+
+LTOResumePass::LTOResumePass(FunctionPassManager FPM) : FPM(std::move(FPM)) {}
+
+PreservedAnalyses LTOResumePass::run(Function &F,
+                                     FunctionAnalysisManager &AM) {
+  if (!F.hasFnAttribute(LTODeferredAttr)) {
+    return PreservedAnalyses::all();
+  }
+  F.removeFnAttr(LTODeferredAttr);
+
+  // ThinLTO turns the copies the linker did not keep into
+  // available_externally ones
+  if (F.isDeclaration() || F.hasAvailableExternallyLinkage()) {
+    return PreservedAnalyses::all();
+  }
+
+  ++Resumed;
+  return FPM.run(F, AM);
+}
@@ -0,0 +1,84 @@
+//===- LinkTime.h - Link-time obfuscation stage ---------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains includes and defines for the link-time stage
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _LINK_TIME_INCLUDES_
+#define _LINK_TIME_INCLUDES_
+
+// LLVM include
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+#include <memory>
+
+namespace llvm {
+// Attribute of the functions left to the link-time stage
+static const char LTODeferredAttr[] = "obf-lto-deferred";
+
+// Phase of a pipeline, when its pass builder tells it (LLVM 20): set while
+// the pipeline is built, read by its passes once it runs
+struct LTOPhase {
+  bool known = false;
+  bool preLink = false;
+  bool postLink = false;
+};
+
+// Whether a link-time stage runs on M after this pipeline: a pre-link
+// pipeline of LLVM 20, or else a module compiled for full LTO, which clang
+// tells with a ThinLTO module flag of 0. Warns once if not.
+bool reachesLinkTime(const Module &M, const LTOPhase &phase);
+
+/* LTODeferPass
+ *
+ * Runs the compile-time passes except on linkonce_odr functions, which every
+ * translation unit using them defines and the linker deduplicates. These are
+ * tagged with LTODeferredAttr instead, so that LTOResumePass obfuscates the
+ * copy kept by the linker once. Without a link-time stage, all the functions
+ * are obfuscated at compile time.
+ */
+struct LTODeferPass : public PassInfoMixin<LTODeferPass> {
+  LTODeferPass(FunctionPassManager FPM,
+               std::shared_ptr<const LTOPhase> phase);
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
+
+  FunctionPassManager FPM;
+  std::shared_ptr<const LTOPhase> phase;
+};
+
+/* LTODeferModulePass
+ *
+ * Runs module passes the link-time stage also runs, such as
+ * string-encryption, only when no link-time stage follows the compilation.
+ */
+struct LTODeferModulePass : public PassInfoMixin<LTODeferModulePass> {
+  LTODeferModulePass(ModulePassManager MPM,
+                     std::shared_ptr<const LTOPhase> phase);
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM);
+
+  ModulePassManager MPM;
+  std::shared_ptr<const LTOPhase> phase;
+};
+
+/* LTOResumePass
+ *
+ * Runs the link-time passes on the functions tagged by LTODeferPass and
+ * removes the tag.
+ */
+struct LTOResumePass : public PassInfoMixin<LTOResumePass> {
+  LTOResumePass(FunctionPassManager FPM);
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
+
+  FunctionPassManager FPM;
+};
+} // namespace llvm
+
+#endif
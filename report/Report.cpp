@@ -0,0 +1,360 @@
+//===- Report.cpp - JSON report of the obfuscation passes -----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the obfuscation report.
+//
+// The passes are recognized by name in the pass instrumentation callbacks, so
+// they do not need to know about the report apart from their own counters.
+// Each run records the wall time, the instruction and block counts of the
+// function (or of the module for the module passes) before and after, the
+// counters and the heap usage after the run. The report holds every run and
+// a summary per pass, to which each pipeline adds its runs when it ends:
+//
+// {
+//   "passes": {"FlatteningObfuscatorPass": {"runs": 2, "seconds": ...}},
+//   "peak_memory": 1234567,
+//   "runs": [{"pass": "FlatteningObfuscatorPass", "function": "main", ...}]
+// }
+//
+//===----------------------------------------------------------------------===//
+
+#include "Report.h"
+#include "bogus/BogusControlFlow.h"
+#include "cache/FunctionCache.h"
+#include "flattening/Flattening.h"
+#include "split/SplitBasicBlocks.h"
+#include "string/StringObfuscation.h"
+#include "substitution/Substitution.h"
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+// A run of a pass on a function, or on a module for the module passes
+struct PassRun {
+  std::string pass;
+  std::string unit;
+  std::chrono::steady_clock::time_point start;
+  double seconds = 0;
+  uint64_t instructionsBefore = 0;
+  uint64_t instructionsAfter = 0;
+  uint64_t blocksBefore = 0;
+  uint64_t blocksAfter = 0;
+  size_t memory = 0;
+  MapVector<StringRef, uint64_t> counters;
+};
+
+// Filled by every thread, written when a pipeline ends
+struct Report {
+  ~Report();
+
+  std::string path;
+  std::mutex lock;
+  std::vector<PassRun> runs;
+  size_t peakMemory = 0;
+};
+} // namespace
+
+static Report &getReport() {
+  static Report report;
+  return report;
+}
+
+// The passes running on this thread, innermost last (the cache runs the
+// passes it wraps)
+static thread_local SmallVector<PassRun, 2> running;
+
+static bool isObfuscationPass(StringRef PassID) {
+  return PassID == BogusControlFlowPass::name() ||
+         PassID == FlatteningObfuscatorPass::name() ||
+         PassID == SplitBasicBlockPass::name() ||
+         PassID == SubstitutionPass::name() ||
+         PassID == StringObfuscatorPass::name() ||
+         PassID == FunctionCachePass::name();
+}
+
+static void countIR(const Function &F, uint64_t &instructions,
+                    uint64_t &blocks) {
+  blocks += F.size();
+  for (const BasicBlock &BB : F) {
+    instructions += BB.size();
+  }
+}
+
+// Returns the IR unit if it is a T, null otherwise
+template <typename T> static const T *getUnit(const Any &IR) {
+#if LLVM_VERSION_MAJOR >= 16
+  const T *const *unit = any_cast<const T *>(&IR);
+  return unit ? *unit : nullptr;
+#else
+  return any_isa<const T *>(IR) ? any_cast<const T *>(IR) : nullptr;
+#endif
+}
+
+static void countIR(const Any &IR, uint64_t &instructions, uint64_t &blocks) {
+  if (const Function *F = getUnit<Function>(IR)) {
+    countIR(*F, instructions, blocks);
+  } else if (const Module *M = getUnit<Module>(IR)) {
+    for (const Function &F : *M) {
+      countIR(F, instructions, blocks);
+    }
+  }
+}
+
+std::string llvm::getUnitName(const Any &IR) {
+  if (const Function *F = getUnit<Function>(IR)) {
+    return F->getName().str();
+  }
+  if (const Module *M = getUnit<Module>(IR)) {
+    return M->getModuleIdentifier();
+  }
+  return "";
+}
+
+static void beginRun(StringRef PassID, const Any &IR) {
+  PassRun run;
+  run.pass = PassID.str();
+  run.unit = getUnitName(IR);
+  countIR(IR, run.instructionsBefore, run.blocksBefore);
+  run.start = std::chrono::steady_clock::now();
+  running.push_back(std::move(run));
+}
+
+// IR is null if the pass invalidated it
+static void endRun(const Any *IR) {
+  if (running.empty()) {
+    return;
+  }
+
+  PassRun run = running.pop_back_val();
+  run.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - run.start)
+                    .count();
+  if (IR) {
+    countIR(*IR, run.instructionsAfter, run.blocksAfter);
+  }
+  run.memory = sys::Process::GetMallocUsage();
+
+  Report &report = getReport();
+  std::lock_guard<std::mutex> guard(report.lock);
+  report.peakMemory = std::max(report.peakMemory, run.memory);
+  report.runs.push_back(std::move(run));
+}
+
+static json::Object getCounts(const PassRun &run) {
+  json::Object counts{{"seconds", run.seconds},
+                      {"instructions_before", int64_t(run.instructionsBefore)},
+                      {"instructions_after", int64_t(run.instructionsAfter)},
+                      {"blocks_before", int64_t(run.blocksBefore)},
+                      {"blocks_after", int64_t(run.blocksAfter)}};
+  for (auto &counter : run.counters) {
+    counts[counter.first] = int64_t(counter.second);
+  }
+  return counts;
+}
+
+static json::Object toJSON(const std::vector<PassRun> &runs,
+                           size_t peakMemory) {
+  // Summary per pass
+  MapVector<StringRef, SmallVector<const PassRun *, 0>> passes;
+  for (const PassRun &run : runs) {
+    passes[run.pass].push_back(&run);
+  }
+
+  json::Object summary;
+  for (auto &pass : passes) {
+    PassRun total;
+    for (const PassRun *run : pass.second) {
+      total.seconds += run->seconds;
+      total.instructionsBefore += run->instructionsBefore;
+      total.instructionsAfter += run->instructionsAfter;
+      total.blocksBefore += run->blocksBefore;
+      total.blocksAfter += run->blocksAfter;
+      for (auto &counter : run->counters) {
+        total.counters[counter.first] += counter.second;
+      }
+    }
+
+    json::Object counts = getCounts(total);
+    counts["runs"] = int64_t(pass.second.size());
+    summary[pass.first.str()] = std::move(counts);
+  }
+
+  json::Array array;
+  for (const PassRun &run : runs) {
+    json::Object object = getCounts(run);
+    object["pass"] = run.pass;
+    object["function"] = run.unit;
+    object["memory"] = int64_t(run.memory);
+    array.push_back(std::move(object));
+  }
+
+  return json::Object{{"passes", std::move(summary)},
+                      {"peak_memory", int64_t(peakMemory)},
+                      {"runs", std::move(array)}};
+}
+
+// Adds the runs and the pass sums of from to the report into, which another
+// compilation wrote
+static void mergeReports(json::Object &into, json::Object &from) {
+  json::Object *passes = into.getObject("passes");
+  json::Array *runs = into.getArray("runs");
+  if (!passes || !runs) {
+    into = std::move(from);
+    return;
+  }
+
+  for (auto &pass : *from.getObject("passes")) {
+    json::Object *total = passes->getObject(pass.first);
+    if (!total) {
+      (*passes)[pass.first] = std::move(pass.second);
+      continue;
+    }
+    for (auto &count : *pass.second.getAsObject()) {
+      json::Value &sum = (*total)[count.first];
+      auto a = sum.getAsInteger(), b = count.second.getAsInteger();
+      if (a && b) {
+        sum = *a + *b;
+        continue;
+      }
+      auto x = sum.getAsNumber(), y = count.second.getAsNumber();
+      sum = (x ? *x : 0) + (y ? *y : 0);
+    }
+  }
+
+  int64_t peak = *from.getInteger("peak_memory");
+  if (auto old = into.getInteger("peak_memory")) {
+    peak = std::max(peak, *old);
+  }
+  into["peak_memory"] = peak;
+  for (json::Value &run : *from.getArray("runs")) {
+    runs->push_back(std::move(run));
+  }
+}
+
+// Merges the runs recorded so far into the file, under a file lock since the
+// compilations running in parallel share it. report.lock is held.
+static void writeReport(Report &report) {
+  if (report.path.empty() || report.runs.empty()) {
+    return;
+  }
+  json::Object fresh = toJSON(report.runs, report.peakMemory);
+  report.runs.clear();
+
+  int fd;
+  std::error_code EC = sys::fs::openFileForReadWrite(
+      report.path, fd, sys::fs::CD_OpenAlways, sys::fs::OF_Text);
+  if (!EC) {
+    EC = sys::fs::lockFile(fd);
+    if (EC) {
+      sys::Process::SafelyCloseFileDescriptor(fd);
+    }
+  }
+  if (EC) {
+    errs() << "LLVM_OBF_REPORT: " << EC.message() << "\n";
+    return;
+  }
+
+  // An empty or foreign file is replaced
+  json::Object merged;
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getOpenFile(
+      sys::fs::convertFDToNativeFile(fd), report.path, -1,
+      /* RequiresNullTerminator */ false, /* IsVolatile */ true);
+  if (buffer) {
+    Expected<json::Value> old = json::parse((*buffer)->getBuffer());
+    if (old && old->getAsObject()) {
+      merged = std::move(*old->getAsObject());
+    } else if (!old) {
+      consumeError(old.takeError());
+    }
+  }
+  mergeReports(merged, fresh);
+
+  // Closing the file releases the lock
+  raw_fd_ostream os(fd, /* shouldClose */ true);
+  sys::fs::resize_file(fd, 0);
+  os.seek(0);
+  os << formatv("{0:2}", json::Value(std::move(merged))) << "\n";
+}
+
+// Runs left over by the pipelines whose end was not seen
+Report::~Report() { writeReport(*this); }
+
+namespace {
+// Moved into the callbacks of a pipeline, which are destroyed with its pass
+// instrumentation once the pipeline has run: the report of a module is then
+// written even if the process gets killed later.
+struct PipelineEnd {
+  PipelineEnd() = default;
+  PipelineEnd(PipelineEnd &&other) : active(other.active) {
+    other.active = false;
+  }
+  ~PipelineEnd() {
+    if (active) {
+      Report &report = getReport();
+      std::lock_guard<std::mutex> guard(report.lock);
+      writeReport(report);
+    }
+  }
+
+  bool active = true;
+};
+} // namespace
+
+void llvm::registerObfuscationReport(PassInstrumentationCallbacks &PIC) {
+  const char *path = getenv("LLVM_OBF_REPORT");
+  if (path == NULL) {
+    return;
+  }
+
+  Report &report = getReport();
+  {
+    std::lock_guard<std::mutex> guard(report.lock);
+    report.path = path;
+  }
+
+  PIC.registerBeforeNonSkippedPassCallback(
+      [end = PipelineEnd()](StringRef PassID, Any IR) {
+        if (isObfuscationPass(PassID)) {
+          beginRun(PassID, IR);
+        }
+      });
+  PIC.registerAfterPassCallback(
+      [](StringRef PassID, Any IR, const PreservedAnalyses &) {
+        if (isObfuscationPass(PassID)) {
+          endRun(&IR);
+        }
+      });
+  PIC.registerAfterPassInvalidatedCallback(
+      [](StringRef PassID, const PreservedAnalyses &) {
+        if (isObfuscationPass(PassID)) {
+          endRun(nullptr);
+        }
+      });
+}
+
+void llvm::reportCount(StringRef counter, uint64_t n) {
+  if (!running.empty()) {
+    running.back().counters[counter] += n;
+  }
+}
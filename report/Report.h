@@ -0,0 +1,40 @@
+//===- Report.h - JSON report of the obfuscation passes -------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains includes and defines for the obfuscation report
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _REPORT_INCLUDES_
+#define _REPORT_INCLUDES_
+
+// LLVM include
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/PassInstrumentation.h"
+
+#include <cstdint>
+#include <string>
+
+namespace llvm {
+// Records every run of an obfuscation pass if the environment variable
+// LLVM_OBF_REPORT is set. The runs are merged into the JSON report of the file
+// it names when the pipeline of PIC ends.
+void registerObfuscationReport(PassInstrumentationCallbacks &PIC);
+
+// Adds n to the counter of the obfuscation pass running on this thread, for
+// what the instruction and block counts do not show (allocas added by
+// fixStack, encrypted strings...). Does nothing if the report is disabled.
+void reportCount(StringRef counter, uint64_t n);
+
+// Name of the function, or identifier of the module, of a pass
+// instrumentation IR unit, empty for the other units
+std::string getUnitName(const Any &IR);
+} // namespace llvm
+
+#endif
@@ -27,6 +27,7 @@ namespace llvm {
 
 // Stats
 STATISTIC(Split, "Basicblock splitted");
+STATISTIC(Skipped, "Functions already splitted, skipped");
 
 static cl::opt<int> SplitNum("split_num", cl::init(2),
                              cl::desc("Split <split_num> time each BB"));
@@ -63,10 +64,16 @@ bool SplitBasicBlock::runSplitBasicBlock(Function &F) {
   }
 
   Function *tmp = &F;
+  if (isObfuscated(tmp, "split")) {
+    ++Skipped;
+    return false;
+  }
 
   // Do we obfuscate
   if (toObfuscate(flag, tmp, "split")) {
+    ValueNamesScope names(F.getContext());
     split(tmp);
+    markObfuscated(tmp, "split");
     ++Split;
     return true;
   }
@@ -77,7 +84,7 @@ SplitBasicBlockPass::SplitBasicBlockPass() { this->flag = true; }
 
 void SplitBasicBlock::split(Function *f) {
   std::vector<BasicBlock *> origBB;
-  int splitN = SplitNum;
+  const bool probeStack = f->hasFnAttribute("probe-stack");
 
   // Save all basic blocks
   for (Function::iterator I = f->begin(), IE = f->end(); I != IE; ++I) {
@@ -88,79 +95,69 @@ void SplitBasicBlock::split(Function *f) {
                                            IE = origBB.end();
        I != IE; ++I) {
     BasicBlock *curr = *I;
+    BasicBlock::iterator it = curr->begin(), ie = curr->end();
 
-    // No need to split a 1 inst bb
-    // Or ones containing a PHI node
-    if (curr->size() < 2 || containsPHI(curr)) {
+    // No need to split an empty bb
+    // Or ones containing a PHI node (they always come first)
+    if (it == ie || isa<PHINode>(it)) {
       continue;
     }
 
-    // Check splitN and current BB size
-    if ((size_t)splitN >= curr->size()) {
-      splitN = curr->size() - 1;
-    }
-
-    // Generate splits point
-    std::vector<int> test;
-    for (unsigned i = 1; i < curr->size(); ++i) {
-      test.push_back(i);
-    }
-
-    // Shuffle
-    if (test.size() != 1) {
-      shuffle(test);
-      std::sort(test.begin(), test.begin() + splitN);
-    }
-
-    // Split
-    BasicBlock::iterator it = curr->begin();
-    BasicBlock *toSplit = curr;
-    int last = 0;
-    for (int i = 0; i < splitN; ++i) {
-      for (int j = 0; j < test[i] - last; ++j) {
-        ++it;
-      }
-      last = test[i];
-      if (toSplit->size() < 2)
-        continue;
-
-      /* TODO: find a real fix or try with the probe-stack inline-asm when its
-       * ready. See https://github.com/Rust-for-Linux/linux/issues/355.
-       * Sometimes moving an alloca from the entry block to the second block
-       * causes a segfault when using the "probe-stack" attribute (observed with
-       * with Rust programs). To avoid this issue we just split the entry block
-       * after the allocas in this case.
-       */
-      if (f->hasFnAttribute("probe-stack") &&
+    /* TODO: find a real fix or try with the probe-stack inline-asm when its
+     * ready. See https://github.com/Rust-for-Linux/linux/issues/355.
+     * Sometimes moving an alloca from the entry block to the second block
+     * causes a segfault when using the "probe-stack" attribute (observed with
+     * with Rust programs). To avoid this issue we never split the entry block
+     * in front of an alloca in this case.
+     */
+    const bool skipAllocas = probeStack &&
 #if LLVM_VERSION_MAJOR < 13
-          (curr == &curr->getParent()->getEntryBlock())
+                             (curr == &curr->getParent()->getEntryBlock());
 #else
-          curr->isEntryBlock()
+                             curr->isEntryBlock();
 #endif
-          && isa<AllocaInst>(it)) {
+
+    // Generate splits point in a single walk over the block: every
+    // instruction but the first one is a candidate, and we keep a uniform
+    // sample of SplitNum of them (reservoir sampling) along with their
+    // position in the block.
+    SmallVector<std::pair<unsigned, BasicBlock::iterator>, 10> points;
+    unsigned candidates = 0;
+    for (++it; it != ie; ++it) {
+      if (skipAllocas && isa<AllocaInst>(it)) {
         continue;
       }
 
-      toSplit = toSplit->splitBasicBlock(it, toSplit->getName() + ".split");
+      if (candidates < (unsigned)SplitNum) {
+        points.push_back(std::make_pair(candidates, it));
+      } else {
+        uint32_t slot = cryptoutils->get_range(candidates + 1);
+        if (slot < (unsigned)SplitNum) {
+          points[slot] = std::make_pair(candidates, it);
+        }
+      }
+      ++candidates;
     }
 
-    ++Split;
-  }
-}
+    // No need to split a 1 inst bb
+    if (points.empty()) {
+      continue;
+    }
 
-bool SplitBasicBlock::containsPHI(BasicBlock *b) {
-  for (BasicBlock::iterator I = b->begin(), IE = b->end(); I != IE; ++I) {
-    if (isa<PHINode>(I)) {
-      return true;
+    std::sort(points.begin(), points.end(),
+              [](const std::pair<unsigned, BasicBlock::iterator> &a,
+                 const std::pair<unsigned, BasicBlock::iterator> &b) {
+                return a.first < b.first;
+              });
+
+    // Split, starting from the last point so that every instruction is moved
+    // to its new block at most once. Each new block is inserted right after
+    // curr, which keeps the blocks in program order.
+    for (auto P = points.rbegin(), PE = points.rend(); P != PE; ++P) {
+      curr->splitBasicBlock(P->second, curr->getName() + ".split");
     }
-  }
-  return false;
-}
 
-void SplitBasicBlock::shuffle(std::vector<int> &vec) {
-  int n = vec.size();
-  for (int i = n - 1; i > 0; --i) {
-    std::swap(vec[i], vec[cryptoutils->get_uint32_t() % (i + 1)]);
+    ++Split;
   }
 }
 } // namespace llvm
@@ -34,9 +34,6 @@ struct SplitBasicBlock {
 
   bool runSplitBasicBlock(Function &F);
   void split(Function *f);
-
-  bool containsPHI(BasicBlock *b);
-  void shuffle(std::vector<int> &vec);
 };
 
 struct SplitBasicBlockPass : public PassInfoMixin<SplitBasicBlockPass>,
@@ -1,17 +1,24 @@
 #include "StringObfuscation.h"
-#include "string/decode.h"
+#include "report/Report.h"
 #include "utils/Utils.h"
 #include "llvm/Analysis/AssumptionCache.h"
+#if LLVM_VERSION_MAJOR >= 18
+#include "llvm/Analysis/DomConditionCache.h"
+#endif
 #include "llvm/Analysis/LazyValueInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils.h"
-#include "llvm/Transforms/Utils/Cloning.h"
-#include <llvm/IRReader/IRReader.h>
+#include "llvm/Transforms/Utils/SimplifyLibCalls.h"
 #include <llvm/Transforms/Utils/ModuleUtils.h>
 
 #include "utils/CryptoUtils.h"
@@ -21,8 +28,162 @@ static const unsigned int RandomMaxNameSize = 15;
 static const char ALPHANUM[] =
     "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 
+#define DEBUG_TYPE "string-encryption"
+
 using namespace llvm;
 
+STATISTIC(LibCallsFolded, "Library calls on constant strings folded");
+STATISTIC(MergedStrings, "Identical strings merged at link time");
+STATISTIC(UnusedStrings, "Strings left unused by the folding, not encrypted");
+
+static cl::opt<bool> FoldLibCalls(
+    "string_fold",
+    cl::desc("Choose to fold the library calls on constant strings (strlen, "
+             "strcmp, printf...) before the string-encryption pass makes "
+             "them writable, LLVM_OBF_STRING_FOLD by default"),
+    cl::init(false), cl::Optional);
+
+static cl::opt<int> UnrollSize(
+    "string_unroll",
+    cl::desc("Choose the size up to which the string-encryption pass decodes "
+             "a string inline instead of calling the decode loop"),
+    cl::value_desc("bytes"), cl::init(16), cl::Optional);
+
+static bool isFoldingLibCalls() {
+  if (FoldLibCalls.getNumOccurrences() == 0) {
+    static const bool fromEnv = [] {
+      const char *value = getenv("LLVM_OBF_STRING_FOLD");
+      return value != NULL && StringRef(value) == "y";
+    }();
+    return fromEnv;
+  }
+  return FoldLibCalls;
+}
+
+// The strings encodeAllStrings encrypts
+static bool isCandidate(const GlobalVariable &gv) {
+  return gv.isConstant() && gv.hasInitializer() && !gv.hasExternalLinkage() &&
+         gv.getSection() != "llvm.metadata";
+}
+
+static cl::opt<bool> Arena(
+    "string_arena",
+    cl::desc("Choose to keep the encrypted strings read-only and decode them "
+             "into a page-aligned arena, LLVM_OBF_STRING_ARENA by default"),
+    cl::init(false), cl::Optional);
+
+static bool isArenaMode() {
+  if (Arena.getNumOccurrences() == 0) {
+    static const bool fromEnv = [] {
+      const char *value = getenv("LLVM_OBF_STRING_ARENA");
+      return value != NULL && StringRef(value) == "y";
+    }();
+    return fromEnv;
+  }
+  return Arena;
+}
+
+static cl::opt<bool> Compress(
+    "string_compress",
+    cl::desc("Choose to compress the strings of the arena before encrypting "
+             "them, LLVM_OBF_STRING_COMPRESS by default"),
+    cl::init(false), cl::Optional);
+
+static bool isCompressing() {
+  if (Compress.getNumOccurrences() == 0) {
+    static const bool fromEnv = [] {
+      const char *value = getenv("LLVM_OBF_STRING_COMPRESS");
+      return value != NULL && StringRef(value) == "y";
+    }();
+    return fromEnv;
+  }
+  return Compress;
+}
+
+// LZ77 with byte tokens, which the decompression function of
+// addDecompressFunction reads: a token t below 0x80 is followed by t + 1
+// literals, a token from 0x80 by the 16-bit little-endian distance back in the
+// output of (t & 0x7f) + 3 bytes to copy. The matches are found greedily with
+// the last position of each hash of 3 bytes.
+static std::vector<uint8_t> compress(ArrayRef<uint8_t> input) {
+  static const size_t MaxLiterals = 0x80;
+  static const size_t MinMatch = 3;
+  static const size_t MaxMatch = 0x7f + MinMatch;
+  static const size_t MaxDistance = 0xffff;
+
+  std::vector<uint8_t> output;
+  std::vector<uint32_t> last(1 << 16, UINT32_MAX);
+  auto hash = [&](size_t i) {
+    uint32_t bytes = input[i] << 16 | input[i + 1] << 8 | input[i + 2];
+    return (bytes * 2654435761u) >> 16;
+  };
+
+  size_t literals = 0;
+  auto flushLiterals = [&](size_t end) {
+    while (literals < end) {
+      size_t n = std::min(end - literals, MaxLiterals);
+      output.push_back(n - 1);
+      output.insert(output.end(), input.begin() + literals,
+                    input.begin() + literals + n);
+      literals += n;
+    }
+  };
+
+  size_t i = 0;
+  while (i + MinMatch <= input.size()) {
+    uint32_t &slot = last[hash(i)];
+    size_t candidate = slot;
+    slot = i;
+    if (candidate == UINT32_MAX || i - candidate > MaxDistance ||
+        memcmp(&input[candidate], &input[i], MinMatch) != 0) {
+      ++i;
+      continue;
+    }
+
+    size_t length = MinMatch;
+    while (length < MaxMatch && i + length < input.size() &&
+           input[candidate + length] == input[i + length]) {
+      ++length;
+    }
+    flushLiterals(i);
+    size_t distance = i - candidate;
+    output.push_back(0x80 | (length - MinMatch));
+    output.push_back(distance & 0xff);
+    output.push_back(distance >> 8);
+
+    for (size_t j = i + 1; j < i + length && j + MinMatch <= input.size();
+         ++j) {
+      last[hash(j)] = j;
+    }
+    i += length;
+    literals = i;
+  }
+  flushLiterals(input.size());
+
+  return output;
+}
+
+// The uses of a string moved to the arena or merged with another one point to
+// another global instead, which needs the string to be local and not listed
+// by llvm.used or llvm.compiler.used
+static bool canRedirectUses(const GlobalVariable &gv) {
+  if (!gv.hasLocalLinkage() || gv.hasSection() || gv.hasComdat()) {
+    return false;
+  }
+  SmallVector<const User *, 8> users(gv.user_begin(), gv.user_end());
+  while (!users.empty()) {
+    const User *user = users.pop_back_val();
+    if (isa<Constant>(user) && !isa<GlobalValue>(user)) {
+      users.append(user->user_begin(), user->user_end());
+    } else if (auto *list = dyn_cast<GlobalVariable>(user)) {
+      if (list->getSection() == "llvm.metadata") {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 namespace llvm {
 ConstantDataArray *StringObfuscatorPass::encodeStringDataArray(LLVMContext &ctx,
                                                                const char *str,
@@ -62,6 +223,11 @@ void StringObfuscatorPass::encodeGlobalString(LLVMContext &ctx,
   auto encodedArray = encodeStringDataArray(ctx, str, size, key);
   if (encodedArray != nullptr) {
     gv->setInitializer(encodedArray);
+    if ((isArenaMode() || isCompressing()) && canRedirectUses(*gv)) {
+      this->arenaStrings.push_back(
+          GlobalStringVariable(gv, size, 0, false, key));
+      return;
+    }
     gv->setConstant(false);
     this->globalStrings.push_back(
         GlobalStringVariable(gv, size, 0, false, key));
@@ -87,17 +253,153 @@ void StringObfuscatorPass::encodeStructString(LLVMContext &ctx,
   }
 }
 
-StringObfuscatorPass::StringObfuscatorPass() {}
+StringObfuscatorPass::StringObfuscatorPass(bool linkTime)
+    : linkTime(linkTime) {}
+
+// Every translation unit has its own copy of the literals it uses, which the
+// compile-time passes would encrypt with as many keys and decode in as many
+// constructors. At link time, the C strings with the same contents are
+// replaced with one of them instead, which the module constructor decodes
+// once. Only the strings whose address is not significant (unnamed_addr) can
+// be merged.
+bool StringObfuscatorPass::mergeStrings(Module &M) {
+  DenseMap<Constant *, GlobalVariable *> kept;
+  SmallVector<GlobalVariable *, 16> merged;
+  for (GlobalVariable &gv : M.globals()) {
+    if (!isCandidate(gv) || !gv.hasGlobalUnnamedAddr() ||
+        !canRedirectUses(gv)) {
+      continue;
+    }
+    auto array = dyn_cast<ConstantDataArray>(gv.getInitializer());
+    if (array == nullptr || !array->isCString()) {
+      continue;
+    }
+
+    auto inserted = kept.try_emplace(array, &gv);
+    if (inserted.second) {
+      continue;
+    }
+    GlobalVariable *other = inserted.first->second;
+    if (gv.getAlign().valueOrOne() > other->getAlign().valueOrOne()) {
+      other->setAlignment(gv.getAlign());
+    }
+    gv.replaceAllUsesWith(other);
+    merged.push_back(&gv);
+  }
+
+  for (GlobalVariable *gv : merged) {
+    gv->eraseFromParent();
+  }
+  MergedStrings += merged.size();
+  reportCount("strings_merged", merged.size());
+  return !merged.empty();
+}
+
+// Once encrypted the strings are writable and the optimizer no longer knows
+// their contents, so the library calls on them are folded first, as the
+// instruction combiner does. Only the calls with a string argument are
+// looked at. The strings left unused are then dropped instead of encrypted.
+bool StringObfuscatorPass::foldLibCalls(Module &M,
+                                        ModuleAnalysisManager &MAM) {
+  TimeTraceScope scope("foldLibCalls", M.getModuleIdentifier());
+  FunctionAnalysisManager &FAM =
+      MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  bool changed = false;
+
+  auto onString = [](CallInst *call) {
+    for (Value *arg : call->args()) {
+      auto *gv = dyn_cast<GlobalVariable>(arg->stripPointerCasts());
+      if (gv != NULL && isCandidate(*gv)) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  for (Function &F : M) {
+    if (F.isDeclaration()) {
+      continue;
+    }
+    SmallVector<CallInst *, 16> calls;
+    for (Instruction &I : instructions(F)) {
+      CallInst *call = dyn_cast<CallInst>(&I);
+      if (call != NULL && call->getCalledFunction() != NULL &&
+          call->getCalledFunction()->isDeclaration() && onString(call)) {
+        calls.push_back(call);
+      }
+    }
+    if (calls.empty()) {
+      continue;
+    }
+
+    TargetLibraryInfo &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+    OptimizationRemarkEmitter ORE(&F);
+#if LLVM_VERSION_MAJOR >= 18
+    DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+    DomConditionCache DC;
+    LibCallSimplifier simplifier(M.getDataLayout(), &TLI, &DT, &DC,
+                                 &FAM.getResult<AssumptionAnalysis>(F), ORE,
+                                 nullptr, nullptr);
+#elif LLVM_VERSION_MAJOR >= 16
+    LibCallSimplifier simplifier(M.getDataLayout(), &TLI,
+                                 &FAM.getResult<AssumptionAnalysis>(F), ORE,
+                                 nullptr, nullptr);
+#else
+    LibCallSimplifier simplifier(M.getDataLayout(), &TLI, ORE, nullptr,
+                                 nullptr);
+#endif
+
+    bool folded = false;
+    for (CallInst *call : calls) {
+      IRBuilder<> builder(call);
+      Value *with = simplifier.optimizeCall(call, builder);
+      // The call itself when only its attributes changed
+      if (with == NULL || with == call) {
+        continue;
+      }
+      SmallVector<WeakTrackingVH, 4> operands(call->arg_begin(),
+                                              call->arg_end());
+      call->replaceAllUsesWith(with);
+      call->eraseFromParent();
+      for (WeakTrackingVH &operand : operands) {
+        if (operand) {
+          RecursivelyDeleteTriviallyDeadInstructions(operand, &TLI);
+        }
+      }
+      ++LibCallsFolded;
+      folded = true;
+    }
+    if (folded) {
+      FAM.invalidate(F, PreservedAnalyses::none());
+      changed = true;
+    }
+  }
+
+  for (auto gv = M.global_begin(); gv != M.global_end();) {
+    GlobalVariable &var = *gv++;
+    auto *array = dyn_cast_or_null<ConstantDataArray>(
+        var.hasInitializer() ? var.getInitializer() : nullptr);
+    if (!isCandidate(var) || !var.hasLocalLinkage() || array == NULL ||
+        !array->isCString()) {
+      continue;
+    }
+    var.removeDeadConstantUsers();
+    if (var.use_empty()) {
+      var.eraseFromParent();
+      ++UnusedStrings;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
 
 bool StringObfuscatorPass::encodeAllStrings(Module &M) {
   auto &ctx = M.getContext();
 
   // For each global variable
   for (GlobalVariable &gv : M.globals()) {
-    if (!gv.isConstant()                         // constant
-        || !gv.hasInitializer()                  // unitialized
-        || gv.hasExternalLinkage()               // external
-        || gv.getSection() == "llvm.metadata") { // Intrinsic Global Variables
+    if (!isCandidate(gv)) {
       //|| gv.getSection().find("__objc_methname") != string::npos) { // TODO :
       // is this necessary ?
       continue;
@@ -126,7 +428,78 @@ bool StringObfuscatorPass::encodeAllStrings(Module &M) {
     }
   }
 
-  return !this->globalStrings.empty();
+  return !this->globalStrings.empty() || !this->arenaStrings.empty();
+}
+
+// The ciphertexts are packed into one constant blob, which stays in a
+// read-only section shared by all the processes, and the plaintexts go to an
+// arena at the same offsets, zero-initialized so that it lands in the BSS:
+// only the pages of the arena are private to a process, not the ones of the
+// data section with each string decoded in place. The uses of each string
+// point into the arena, which the constructor fills with a single copy of the
+// blob before decoding the strings.
+//
+// With -string_compress, the blob is the packed plaintext compressed then
+// encrypted with a single key instead, which the constructor decrypts and
+// decompresses into the arena in one pass.
+void StringObfuscatorPass::moveToArena(Module &M) {
+  auto &ctx = M.getContext();
+  Type *i8 = Type::getInt8Ty(ctx);
+
+  std::vector<uint8_t> bytes;
+  std::vector<uint64_t> offsets;
+  for (auto &str : this->arenaStrings) {
+    uint64_t align = str.var->getAlign() ? str.var->getAlign()->value() : 1;
+    bytes.resize(alignTo(bytes.size(), align), 0);
+    offsets.push_back(bytes.size());
+    StringRef data =
+        cast<ConstantDataArray>(str.var->getInitializer())->getRawDataValues();
+    bytes.insert(bytes.end(), data.begin(), data.end());
+  }
+
+  auto arrayType = ArrayType::get(i8, bytes.size());
+  if (isCompressing()) {
+    for (unsigned i = 0; i < this->arenaStrings.size(); ++i) {
+      for (uint64_t j = 0; j < this->arenaStrings[i].size; ++j) {
+        bytes[offsets[i] + j] ^= this->arenaStrings[i].key;
+      }
+    }
+    std::vector<uint8_t> packed = compress(bytes);
+    this->blobKey = cryptoutils->get_uint8_t();
+    for (uint8_t &byte : packed) {
+      byte ^= this->blobKey;
+    }
+    this->blob = new GlobalVariable(
+        M, ArrayType::get(i8, packed.size()), true,
+        GlobalValue::PrivateLinkage, ConstantDataArray::get(ctx, packed));
+  } else {
+    this->blob = new GlobalVariable(M, arrayType, true,
+                                    GlobalValue::PrivateLinkage,
+                                    ConstantDataArray::get(ctx, bytes));
+  }
+  this->blob->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  this->arena = new GlobalVariable(M, arrayType, false,
+                                   GlobalValue::InternalLinkage,
+                                   ConstantAggregateZero::get(arrayType));
+  this->arena->setAlignment(Align(4096));
+
+  for (unsigned i = 0; i < this->arenaStrings.size(); ++i) {
+    GlobalVariable *gv = this->arenaStrings[i].var;
+    Constant *indices[] = {ConstantInt::get(Type::getInt64Ty(ctx), 0),
+                           ConstantInt::get(Type::getInt64Ty(ctx), offsets[i])};
+    Constant *ptr =
+        ConstantExpr::getInBoundsGetElementPtr(arrayType, arena, indices);
+    gv->replaceAllUsesWith(ConstantExpr::getPointerCast(ptr, gv->getType()));
+    gv->eraseFromParent();
+
+    if (isCompressing()) {
+      continue;
+    }
+    this->globalStrings.push_back(GlobalStringVariable(
+        arena, this->arenaStrings[i].size, 0, false, this->arenaStrings[i].key,
+        offsets[i]));
+  }
+  this->arenaStrings.clear();
 }
 
 std::string StringObfuscatorPass::generateRandomName() {
@@ -143,51 +516,224 @@ std::string StringObfuscatorPass::generateRandomName() {
   return name;
 }
 
+// void decode(i8 *str, i32 length, i8 key), the loop decoding the long
+// strings: 16 bytes at a time with vector xors, which the backend lowers to
+// what the target has, then the remaining bytes one by one.
 Function *StringObfuscatorPass::addDecodeFunction(Module &M) {
+  TimeTraceScope scope("addDecodeFunction", M.getModuleIdentifier());
+  auto &ctx = M.getContext();
+  Type *i8 = Type::getInt8Ty(ctx);
+  Type *i32 = Type::getInt32Ty(ctx);
+  auto vectorType = FixedVectorType::get(i8, 16);
+
+  Function *decode = Function::Create(
+      FunctionType::get(Type::getVoidTy(ctx),
+                        {PointerType::getUnqual(i8), i32, i8}, false),
+      GlobalValue::InternalLinkage, generateRandomName(), M);
+  // Called once per long string, inlining it would only grow the constructor
+  decode->addFnAttr(Attribute::NoInline);
+  decode->addFnAttr(Attribute::NoUnwind);
+  Value *str = decode->getArg(0);
+  Value *length = decode->getArg(1);
+  Value *key = decode->getArg(2);
+
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", decode);
+  BasicBlock *vectorLoop = BasicBlock::Create(ctx, "vectorLoop", decode);
+  BasicBlock *tail = BasicBlock::Create(ctx, "tail", decode);
+  BasicBlock *byteLoop = BasicBlock::Create(ctx, "byteLoop", decode);
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", decode);
+
+  IRBuilder<> builder(entry);
+  Value *keys = builder.CreateVectorSplat(16, key);
+  Value *vectorEnd = builder.CreateAnd(length, ~15u);
+  builder.CreateCondBr(builder.CreateICmpEQ(vectorEnd, builder.getInt32(0)),
+                       tail, vectorLoop);
+
+  builder.SetInsertPoint(vectorLoop);
+  PHINode *i = builder.CreatePHI(i32, 2);
+  i->addIncoming(builder.getInt32(0), entry);
+  Value *ptr = builder.CreateBitCast(builder.CreateInBoundsGEP(i8, str, i),
+                                     PointerType::getUnqual(vectorType));
+  Value *chunk = builder.CreateAlignedLoad(vectorType, ptr, Align(1));
+  builder.CreateAlignedStore(builder.CreateXor(chunk, keys), ptr, Align(1));
+  Value *next = builder.CreateAdd(i, builder.getInt32(16));
+  i->addIncoming(next, vectorLoop);
+  builder.CreateCondBr(builder.CreateICmpULT(next, vectorEnd), vectorLoop,
+                       tail);
+
+  builder.SetInsertPoint(tail);
+  PHINode *start = builder.CreatePHI(i32, 2);
+  start->addIncoming(builder.getInt32(0), entry);
+  start->addIncoming(vectorEnd, vectorLoop);
+  builder.CreateCondBr(builder.CreateICmpULT(start, length), byteLoop, exit);
+
+  builder.SetInsertPoint(byteLoop);
+  PHINode *j = builder.CreatePHI(i32, 2);
+  j->addIncoming(start, tail);
+  ptr = builder.CreateInBoundsGEP(i8, str, j);
+  builder.CreateStore(builder.CreateXor(builder.CreateLoad(i8, ptr), key),
+                      ptr);
+  next = builder.CreateAdd(j, builder.getInt32(1));
+  j->addIncoming(next, byteLoop);
+  builder.CreateCondBr(builder.CreateICmpULT(next, length), byteLoop, exit);
+
+  builder.SetInsertPoint(exit);
+  builder.CreateRetVoid();
+
+  return decode;
+}
+
+// void decompress(i8 *out, i8 *in, i32 size, i8 key), which decrypts the size
+// bytes at in and decompresses them to out as it goes, see compress.
+Function *StringObfuscatorPass::addDecompressFunction(Module &M) {
+  TimeTraceScope scope("addDecompressFunction", M.getModuleIdentifier());
   auto &ctx = M.getContext();
+  Type *i8 = Type::getInt8Ty(ctx);
+  Type *i32 = Type::getInt32Ty(ctx);
+
+  Function *decompress = Function::Create(
+      FunctionType::get(Type::getVoidTy(ctx),
+                        {PointerType::getUnqual(i8), PointerType::getUnqual(i8),
+                         i32, i8},
+                        false),
+      GlobalValue::InternalLinkage, generateRandomName(), M);
+  decompress->addFnAttr(Attribute::NoUnwind);
+  Value *out = decompress->getArg(0);
+  Value *in = decompress->getArg(1);
+  Value *size = decompress->getArg(2);
+  Value *key = decompress->getArg(3);
+
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", decompress);
+  BasicBlock *header = BasicBlock::Create(ctx, "header", decompress);
+  BasicBlock *token = BasicBlock::Create(ctx, "token", decompress);
+  BasicBlock *literals = BasicBlock::Create(ctx, "literals", decompress);
+  BasicBlock *match = BasicBlock::Create(ctx, "match", decompress);
+  BasicBlock *disjoint = BasicBlock::Create(ctx, "disjoint", decompress);
+  BasicBlock *copy = BasicBlock::Create(ctx, "copy", decompress);
+  BasicBlock *exit = BasicBlock::Create(ctx, "exit", decompress);
+
+  IRBuilder<> builder(entry);
+  auto readByte = [&](Value *index) {
+    Value *ptr = builder.CreateInBoundsGEP(i8, in, index);
+    return builder.CreateXor(builder.CreateLoad(i8, ptr), key);
+  };
+  builder.CreateBr(header);
+
+  // Positions in the input and the output
+  builder.SetInsertPoint(header);
+  PHINode *inPos = builder.CreatePHI(i32, 4);
+  PHINode *outPos = builder.CreatePHI(i32, 4);
+  inPos->addIncoming(builder.getInt32(0), entry);
+  outPos->addIncoming(builder.getInt32(0), entry);
+  builder.CreateCondBr(builder.CreateICmpULT(inPos, size), token, exit);
+
+  builder.SetInsertPoint(token);
+  Value *t = readByte(inPos);
+  Value *afterToken = builder.CreateAdd(inPos, builder.getInt32(1));
+  builder.CreateCondBr(builder.CreateICmpSLT(t, builder.getInt8(0)), match,
+                       literals);
+
+  // t + 1 literals
+  builder.SetInsertPoint(literals);
+  PHINode *i = builder.CreatePHI(i32, 2);
+  i->addIncoming(builder.getInt32(0), token);
+  builder.CreateStore(
+      readByte(builder.CreateAdd(afterToken, i)),
+      builder.CreateInBoundsGEP(i8, out, builder.CreateAdd(outPos, i)));
+  Value *nextI = builder.CreateAdd(i, builder.getInt32(1));
+  i->addIncoming(nextI, literals);
+  Value *count = builder.CreateAdd(builder.CreateZExt(t, i32),
+                                   builder.getInt32(1));
+  inPos->addIncoming(builder.CreateAdd(afterToken, count), literals);
+  outPos->addIncoming(builder.CreateAdd(outPos, count), literals);
+  builder.CreateCondBr(builder.CreateICmpULT(nextI, count), literals, header);
+
+  // (t & 0x7f) + 3 bytes copied from distance bytes back, one by one when
+  // they overlap the ones being written
+  builder.SetInsertPoint(match);
+  Value *length = builder.CreateAdd(
+      builder.CreateZExt(builder.CreateAnd(t, 0x7f), i32), builder.getInt32(3));
+  Value *distance = builder.CreateOr(
+      builder.CreateZExt(readByte(afterToken), i32),
+      builder.CreateShl(
+          builder.CreateZExt(
+              readByte(builder.CreateAdd(afterToken, builder.getInt32(1))),
+              i32),
+          8));
+  Value *from = builder.CreateSub(outPos, distance);
+  Value *matchIn = builder.CreateAdd(afterToken, builder.getInt32(2));
+  Value *matchOut = builder.CreateAdd(outPos, length);
+  inPos->addIncoming(matchIn, disjoint);
+  outPos->addIncoming(matchOut, disjoint);
+  builder.CreateCondBr(builder.CreateICmpULT(distance, length), copy,
+                       disjoint);
+
+  builder.SetInsertPoint(disjoint);
+  builder.CreateMemCpy(builder.CreateInBoundsGEP(i8, out, outPos), Align(1),
+                       builder.CreateInBoundsGEP(i8, out, from), Align(1),
+                       length);
+  builder.CreateBr(header);
+
+  builder.SetInsertPoint(copy);
+  PHINode *j = builder.CreatePHI(i32, 2);
+  j->addIncoming(builder.getInt32(0), match);
+  Value *byte = builder.CreateLoad(
+      i8, builder.CreateInBoundsGEP(i8, out, builder.CreateAdd(from, j)));
+  builder.CreateStore(
+      byte, builder.CreateInBoundsGEP(i8, out, builder.CreateAdd(outPos, j)));
+  Value *nextJ = builder.CreateAdd(j, builder.getInt32(1));
+  j->addIncoming(nextJ, copy);
+  inPos->addIncoming(matchIn, copy);
+  outPos->addIncoming(matchOut, copy);
+  builder.CreateCondBr(builder.CreateICmpULT(nextJ, length), copy, header);
+
+  builder.SetInsertPoint(exit);
+  builder.CreateRetVoid();
 
-  // Parse the bitcode from the header (creates a new module which contains
-  // the decode function)
-  SMDiagnostic err;
-  auto buf = MemoryBuffer::getMemBuffer(
-      StringRef(reinterpret_cast<const char *>(decode_c_bc), decode_c_bc_len),
-      "", false);
-  std::unique_ptr<Module> decodeModule =
-      parseIR(buf->getMemBufferRef(), err, ctx);
-  Function *loadedFunction = decodeModule->getFunction("decodeString");
-
-  // Declare the decode function in M with the same signature as the loaded
-  // function
-  auto functionName = generateRandomName();
-  M.getOrInsertFunction(functionName, loadedFunction->getFunctionType());
-  Function *declaredFunction = M.getFunction(functionName);
-
-  // Map the declared and loaded functions arguments
-  ValueToValueMapTy vmap;
-  auto larg = loadedFunction->arg_begin();
-  for (auto darg = declaredFunction->arg_begin();
-       darg != declaredFunction->arg_end(); darg++) {
-    vmap[&*larg] = &*darg;
-    larg++;
-  }
-
-  // Copy the loaded function into the empty declared function (in the proper
-  // module)
-  SmallVector<ReturnInst *, 8> returns;
-  ClonedCodeInfo codeInfo;
-  CloneFunctionInto(declaredFunction, loadedFunction, vmap,
-#if LLVM_VERSION_MAJOR < 13
-                    true,
-#else
-                    CloneFunctionChangeType::DifferentModule,
-#endif
-                    returns, "", &codeInfo);
+  return decompress;
+}
+
+// Decodes the size bytes at ptr. Up to -string_unroll bytes, the string is
+// decoded inline with the widest legal integers of the target (64 bits if the
+// module has no data layout), xored with the key repeated in a constant, then
+// smaller ones for the rest. The longer strings are left to the decode loop.
+void StringObfuscatorPass::addDecode(IRBuilder<> &builder, Value *ptr,
+                                     uint64_t size, uint8_t key) {
+  Module &M = *builder.GetInsertBlock()->getModule();
+  auto &ctx = M.getContext();
+  Type *i8 = Type::getInt8Ty(ctx);
 
-  return declaredFunction;
+  if (size > static_cast<uint64_t>(std::max(UnrollSize.getValue(), 0))) {
+    if (this->decodeFunction == nullptr) {
+      this->decodeFunction = addDecodeFunction(M);
+    }
+    builder.CreateCall(this->decodeFunction,
+                       {ptr, builder.getInt32(size), builder.getInt8(key)});
+    return;
+  }
+
+  unsigned width = M.getDataLayout().getLargestLegalIntTypeSizeInBits() / 8;
+  if (width == 0) {
+    width = 8;
+  }
+  uint64_t offset = 0;
+  for (; width > 0; width /= 2) {
+    auto wordType = IntegerType::get(ctx, width * 8);
+    auto keys = ConstantInt::get(wordType, APInt::getSplat(width * 8,
+                                                           APInt(8, key)));
+    for (; offset + width <= size; offset += width) {
+      Value *word = builder.CreateBitCast(
+          builder.CreateConstInBoundsGEP1_64(i8, ptr, offset),
+          PointerType::getUnqual(wordType));
+      builder.CreateAlignedStore(
+          builder.CreateXor(builder.CreateAlignedLoad(wordType, word, Align(1)),
+                            keys),
+          word, Align(1));
+    }
+  }
 }
 
-void StringObfuscatorPass::addDecodeAllStringsFunction(
-    Module &M, Function *decodeFunction) {
+void StringObfuscatorPass::addDecodeAllStringsFunction(Module &M) {
   auto &ctx = M.getContext();
 
   FunctionCallee callee =
@@ -199,12 +745,31 @@ void StringObfuscatorPass::addDecodeAllStringsFunction(
   BasicBlock *decodeBlock =
       BasicBlock::Create(ctx, "decodeBlock", decodeAllStrings);
 
-  // Insert function calls to decodeFunction to decrypt each encrypted string
-  // in the main
+  // Decode each encrypted string
   IRBuilder<> builder(decodeBlock);
+  if (this->arena != nullptr && isCompressing()) {
+    auto blobType = this->blob->getValueType();
+    builder.CreateCall(
+        addDecompressFunction(M),
+        {builder.CreateConstInBoundsGEP2_32(this->arena->getValueType(),
+                                            this->arena, 0, 0),
+         builder.CreateConstInBoundsGEP2_32(blobType, this->blob, 0, 0),
+         builder.getInt32(blobType->getArrayNumElements()),
+         builder.getInt8(this->blobKey)});
+  } else if (this->arena != nullptr) {
+    builder.CreateMemCpy(this->arena, Align(4096), this->blob, Align(1),
+                         this->arena->getValueType()->getArrayNumElements());
+  }
   for (auto str : this->globalStrings) {
     Value *array = str.var;
 
+    if (str.var == this->arena) {
+      auto ptr = builder.CreateConstInBoundsGEP2_64(str.var->getValueType(),
+                                                    array, 0, str.offset);
+      addDecode(builder, ptr, str.size, str.key);
+      continue;
+    }
+
     // If this is a struct we need to get a pointer to the array
     // at the field index
     if (str.isStruct) {
@@ -219,13 +784,7 @@ void StringObfuscatorPass::addDecodeAllStringsFunction(
     auto ptr = builder.CreateConstInBoundsGEP2_32(
         arrayType, array, 0, 0);
 
-    // Get the size of the string
-    auto size = ConstantInt::get(IntegerType::getInt32Ty(ctx), str.size);
-
-    auto key = ConstantInt::get(IntegerType::getInt8Ty(ctx), str.key);
-
-    // Call the decode function
-    builder.CreateCall(decodeFunction, {ptr, size, key});
+    addDecode(builder, ptr, str.size, str.key);
   }
 
   builder.CreateRetVoid();
@@ -236,16 +795,29 @@ void StringObfuscatorPass::addDecodeAllStringsFunction(
 
 PreservedAnalyses StringObfuscatorPass::run(Module &M,
                                             ModuleAnalysisManager &MAM) {
+  ValueNamesScope names(M.getContext());
+
+  bool changed = isFoldingLibCalls() && foldLibCalls(M, MAM);
+  if (linkTime) {
+    changed |= mergeStrings(M);
+  }
+
   // Encode all the global strings
   if (!encodeAllStrings(M)) {
-    return PreservedAnalyses::all();
+    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+  }
+  reportCount("strings", globalStrings.size() + arenaStrings.size());
+  if (!arenaStrings.empty()) {
+    moveToArena(M);
+    reportCount("arena_bytes", arena->getValueType()->getArrayNumElements());
+    if (isCompressing()) {
+      reportCount("compressed_bytes",
+                  blob->getValueType()->getArrayNumElements());
+    }
   }
-
-  // Insert a function to decode a string
-  Function *decodeFunction = addDecodeFunction(M);
 
   // Insert a function decoding all the strings in global constructors
-  addDecodeAllStringsFunction(M, decodeFunction);
+  addDecodeAllStringsFunction(M);
 
   return PreservedAnalyses::none();
 }
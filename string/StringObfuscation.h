@@ -6,6 +6,7 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
@@ -19,22 +20,38 @@ struct GlobalStringVariable {
   unsigned int index;
   bool isStruct;
   uint8_t key;
+  // Offset of the string in var when var is the arena
+  uint64_t offset;
 
   GlobalStringVariable(llvm::GlobalVariable *var, size_t size,
-                       unsigned int index, bool isStruct, uint8_t key) {
+                       unsigned int index, bool isStruct, uint8_t key,
+                       uint64_t offset = 0) {
     this->var = var;
     this->size = size;
     this->index = index;
     this->isStruct = isStruct;
     this->key = key;
+    this->offset = offset;
   }
 };
 
 namespace llvm {
 struct StringObfuscatorPass : public PassInfoMixin<StringObfuscatorPass> {
   std::vector<GlobalStringVariable> globalStrings;
+  // With -string_arena, the strings decoded into the arena, their ciphertext
+  // packed in the read-only blob
+  std::vector<GlobalStringVariable> arenaStrings;
+  GlobalVariable *arena = nullptr;
+  GlobalVariable *blob = nullptr;
+  // With -string_compress, the key of the compressed blob
+  uint8_t blobKey = 0;
+  // At link time, the identical strings of the merged translation units are
+  // merged before being encrypted
+  bool linkTime;
+  // The decode loop of the long strings, added with the first one
+  Function *decodeFunction = nullptr;
 
-  StringObfuscatorPass();
+  StringObfuscatorPass(bool linkTime = false);
   ConstantDataArray *encodeStringDataArray(LLVMContext &ctx, const char *str,
                                            size_t size, uint8_t key);
   void encodeStructString(LLVMContext &ctx, GlobalVariable *gv,
@@ -42,10 +59,16 @@ struct StringObfuscatorPass : public PassInfoMixin<StringObfuscatorPass> {
                           unsigned int index);
   void encodeGlobalString(LLVMContext &ctx, GlobalVariable *gv,
                           ConstantDataArray *array);
+  bool foldLibCalls(Module &M, ModuleAnalysisManager &MAM);
+  bool mergeStrings(Module &M);
   bool encodeAllStrings(Module &M);
+  void moveToArena(Module &M);
   std::string generateRandomName();
   Function *addDecodeFunction(Module &M);
-  void addDecodeAllStringsFunction(Module &M, Function *decodeFunction);
+  Function *addDecompressFunction(Module &M);
+  void addDecode(IRBuilder<> &builder, Value *ptr, uint64_t size,
+                 uint8_t key);
+  void addDecodeAllStringsFunction(Module &M);
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
 };
 
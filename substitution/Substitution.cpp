@@ -13,6 +13,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "Substitution.h"
+#include "budget/Budget.h"
 #include "utils/Utils.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Intrinsics.h"
@@ -41,6 +42,7 @@ STATISTIC(Sub, "Sub substitued");
 STATISTIC(And, "And substitued");
 STATISTIC(Or, "Or substitued");
 STATISTIC(Xor, "Xor substitued");
+STATISTIC(Skipped, "Functions already substitued, skipped");
 
 Substitution::Substitution() { registerFuncs(); }
 
@@ -77,6 +79,12 @@ SubstitutionPass::SubstitutionPass() {
 
 PreservedAnalyses SubstitutionPass::run(Function &F,
                                         FunctionAnalysisManager &AM) {
+  const ObfuscationIntensity *intensity = getPlannedIntensity(F, AM);
+  plannedTimes = intensity ? intensity->subLoop : -1;
+  if (plannedTimes == 0) {
+    return PreservedAnalyses::all();
+  }
+
   return runSubstitution(F) ? PreservedAnalyses::none()
                             : PreservedAnalyses::all();
 }
@@ -107,9 +115,16 @@ bool Substitution::runSubstitution(Function &F) {
   }
 
   Function *tmp = &F;
+  if (isObfuscated(tmp, "sub")) {
+    ++Skipped;
+    return false;
+  }
+
   // Do we obfuscate
   if (toObfuscate(flag, tmp, "sub")) {
+    ValueNamesScope names(F.getContext());
     substitute(tmp);
+    markObfuscated(tmp, "sub");
     return true;
   }
 
@@ -120,7 +135,7 @@ bool Substitution::substitute(Function *f) {
   Function *tmp = f;
 
   // Loop for the number of time we run the pass on the function
-  int times = ObfTimes;
+  int times = plannedTimes >= 0 ? plannedTimes : (int)ObfTimes;
   do {
     for (Function::iterator bb = tmp->begin(); bb != tmp->end(); ++bb) {
       for (BasicBlock::iterator inst = bb->begin(); inst != bb->end(); ++inst) {
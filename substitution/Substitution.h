@@ -63,6 +63,8 @@ struct Substitution {
   void (Substitution::*funcOr[NUMBER_OR_SUBST])(BinaryOperator *bo);
   void (Substitution::*funcXor[NUMBER_XOR_SUBST])(BinaryOperator *bo);
   bool flag;
+  // Number of loops given by the budget, sub_loop if negative
+  int plannedTimes = -1;
 };
 
 struct SubstitutionPass : public PassInfoMixin<SubstitutionPass>,
@@ -0,0 +1,460 @@
+//===- llvm-obf.cpp - Standalone multi-threaded obfuscation driver --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs an obfuscation pipeline over a whole module, typically the merged
+// module of a LTO build. The module is split into partitions with SplitModule,
+// each partition is obfuscated in its own LLVMContext on a thread pool and the
+// results are linked back together.
+//
+// Each partition draws its random numbers from its own CryptoUtils, seeded
+// from the main seed and the partition index: the output only depends on the
+// seed and the number of partitions, not on the thread scheduling.
+//
+// With -lazy, the module is instead loaded lazily and only the bodies of the
+// selected functions are materialized before running a function pipeline on
+// them, which saves the pass costs of the other functions on huge inputs.
+//
+//===----------------------------------------------------------------------===//
+
+#include "utils/CryptoUtils.h"
+#include "utils/Utils.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
+#if LLVM_VERSION_MAJOR >= 22
+#include "llvm/Plugins/PassPlugin.h"
+#else
+#include "llvm/Passes/PassPlugin.h"
+#endif
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "llvm-obf"
+STATISTIC(NumMaterialized, "Functions materialized by -lazy");
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input bitcode>"),
+                                          cl::init("-"));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+
+static cl::opt<bool> OutputAssembly("S",
+                                    cl::desc("Write output as LLVM assembly"));
+
+static cl::opt<std::string>
+    PassPipeline("passes", cl::Required,
+                 cl::desc("Obfuscation pipeline, same syntax as opt -passes"));
+
+static cl::opt<unsigned>
+    Threads("j", cl::init(0), cl::desc("Number of threads, 0 for all cores"));
+
+static cl::opt<unsigned>
+    Partitions("partitions", cl::init(0),
+               cl::desc("Number of partitions, defaults to the thread count"));
+
+static cl::opt<std::string>
+    Seed("seed", cl::value_desc("hex"),
+         cl::desc("CryptoUtils seed, overrides LLVM_OBF_SEED"));
+
+static cl::opt<bool>
+    Lazy("lazy", cl::desc("Only materialize the selected functions, "
+                          "-passes is then a function pipeline"));
+
+static cl::list<std::string>
+    Functions("functions", cl::CommaSeparated, cl::value_desc("name,..."),
+              cl::desc("With -lazy, select these functions"));
+
+static cl::opt<bool>
+    Annotated("annotated",
+              cl::desc("With -lazy, select the annotated functions"));
+
+// Linkage of the local symbols of the input, by name. SplitModule gives them
+// external hidden linkage so that the partitions can refer to each other.
+struct LocalSymbol {
+  GlobalValue::LinkageTypes linkage;
+  bool named;
+};
+typedef StringMap<LocalSymbol> LocalSymbols;
+
+// Make the local symbols defined in M local again. The passes rely on it, for
+// instance string-encryption leaves external globals alone. The partitions
+// only get the ones no other partition refers to: a pass may delete or replace
+// a local symbol, which would leave the references of the others unresolved.
+static void restoreLocals(Module &M, const LocalSymbols &locals) {
+  for (GlobalValue &GV : M.global_values()) {
+    auto it = locals.find(GV.getName());
+    if (it == locals.end() || GV.isDeclaration() || GV.hasLocalLinkage()) {
+      continue;
+    }
+
+    GV.setVisibility(GlobalValue::DefaultVisibility);
+    GV.setLinkage(it->second.linkage);
+  }
+}
+
+// Undo restoreLocals once the pipeline has run, so that the partitions can be
+// linked.
+static void externalizeLocals(Module &M, const LocalSymbols &locals) {
+  for (auto &local : locals) {
+    GlobalValue *GV = M.getNamedValue(local.getKey());
+    if (GV && !GV->isDeclaration() && GV->hasLocalLinkage()) {
+      GV->setLinkage(GlobalValue::ExternalLinkage);
+      GV->setVisibility(GlobalValue::HiddenVisibility);
+    }
+  }
+}
+
+static Error runPipeline(Module &M, const PassPluginLibraryInfo &plugin) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassInstrumentationCallbacks PIC;
+  PassBuilder PB(nullptr, PipelineTuningOptions(), {}, &PIC);
+
+  plugin.RegisterPassBuilderCallbacks(PB);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  if (Error err = PB.parsePassPipeline(MPM, PassPipeline)) {
+    return err;
+  }
+  MPM.addPass(VerifierPass());
+  MPM.run(M, MAM);
+
+  return Error::success();
+}
+
+static Expected<std::unique_ptr<Module>>
+parsePartition(const SmallVectorImpl<char> &bitcode, LLVMContext &ctx) {
+  return parseBitcodeFile(
+      MemoryBufferRef(StringRef(bitcode.data(), bitcode.size()), "partition"),
+      ctx);
+}
+
+// Obfuscate one partition, given as bitcode, in place. Runs on a worker thread.
+static Error obfuscatePartition(SmallVectorImpl<char> &bitcode,
+                                const std::string &seed,
+                                const LocalSymbols &locals,
+                                const PassPluginLibraryInfo &plugin) {
+  LLVMContext ctx;
+  Expected<std::unique_ptr<Module>> M = parsePartition(bitcode, ctx);
+  if (!M) {
+    return M.takeError();
+  }
+
+  std::unique_ptr<CryptoUtils> utils = std::make_unique<CryptoUtils>();
+  utils->prng_seed(seed);
+  CryptoUtilsScope scope(*utils);
+
+  restoreLocals(**M, locals);
+  if (Error err = runPipeline(**M, plugin)) {
+    return err;
+  }
+  externalizeLocals(**M, locals);
+
+  bitcode.clear();
+  raw_svector_ostream os(bitcode);
+  WriteBitcodeToFile(**M, os);
+
+  return Error::success();
+}
+
+static std::unique_ptr<Module>
+obfuscateInParallel(std::unique_ptr<Module> M, unsigned partitions,
+                    ThreadPoolStrategy strategy,
+                    const PassPluginLibraryInfo &plugin) {
+  LLVMContext &ctx = M->getContext();
+
+  std::vector<std::pair<GlobalValue *, LocalSymbol>> localValues;
+  for (GlobalValue &GV : M->global_values()) {
+    if (GV.hasLocalLinkage()) {
+      localValues.push_back({&GV, {GV.getLinkage(), GV.hasName()}});
+    }
+  }
+
+  // Partitions are handed over to the workers as bitcode, since a module
+  // cannot be moved to another context.
+  std::vector<SmallVector<char, 0>> parts;
+  StringSet<> declared;
+  SplitModule(*M, partitions, [&](std::unique_ptr<Module> part) {
+    for (GlobalValue &GV : part->global_values()) {
+      if (GV.isDeclaration()) {
+        declared.insert(GV.getName());
+      }
+    }
+    parts.emplace_back();
+    raw_svector_ostream os(parts.back());
+    WriteBitcodeToFile(*part, os);
+  });
+
+  // Names are only known now, SplitModule names the unnamed symbols
+  LocalSymbols locals, partitionLocals;
+  for (auto &local : localValues) {
+    locals[local.first->getName()] = local.second;
+    if (!declared.count(local.first->getName())) {
+      partitionLocals[local.first->getName()] = local.second;
+    }
+  }
+  M.reset();
+
+  std::vector<std::string> seeds;
+  for (unsigned i = 0; i < parts.size(); ++i) {
+    seeds.push_back(cryptoutils->derive_seed("partition" + std::to_string(i)));
+  }
+
+  std::vector<std::string> errors(parts.size());
+
+  {
+#if LLVM_VERSION_MAJOR >= 19
+    DefaultThreadPool pool(strategy);
+#else
+    ThreadPool pool(strategy);
+#endif
+    for (unsigned i = 0; i < parts.size(); ++i) {
+      pool.async([&, i] {
+        if (Error err = obfuscatePartition(parts[i], seeds[i],
+                                           partitionLocals, plugin)) {
+          errors[i] = toString(std::move(err));
+        }
+      });
+    }
+    pool.wait();
+  }
+
+  bool failed = false;
+  for (const std::string &error : errors) {
+    if (!error.empty()) {
+      errs() << "llvm-obf: " << error << "\n";
+      failed = true;
+    }
+  }
+  if (failed) {
+    return nullptr;
+  }
+
+  std::unique_ptr<Module> linked;
+  for (auto &part : parts) {
+    Expected<std::unique_ptr<Module>> partM = parsePartition(part, ctx);
+    if (!partM) {
+      errs() << "llvm-obf: " << toString(partM.takeError()) << "\n";
+      return nullptr;
+    }
+    part = SmallVector<char, 0>();
+
+    if (!linked) {
+      linked = std::move(*partM);
+    } else if (Linker::linkModules(*linked, std::move(*partM))) {
+      return nullptr;
+    }
+  }
+
+  // A shared local symbol a partition deleted anyway
+  bool unresolved = false;
+  for (auto &local : locals) {
+    GlobalValue *GV = linked->getNamedValue(local.getKey());
+    if (GV && GV->isDeclaration()) {
+      errs() << "llvm-obf: unresolved local symbol '" << local.getKey()
+             << "'\n";
+      unresolved = true;
+    }
+  }
+  if (unresolved) {
+    return nullptr;
+  }
+
+  restoreLocals(*linked, locals);
+  for (auto &local : locals) {
+    GlobalValue *GV = linked->getNamedValue(local.getKey());
+    if (!local.second.named && GV && GV->hasLocalLinkage()) {
+      GV->setName("");
+    }
+  }
+
+  return linked;
+}
+
+// Tell whether -lazy obfuscates F. Only looks at the name and at the
+// annotations, which are global, so that F does not need to be materialized.
+static bool isSelected(Function &F, const StringSet<> &names) {
+  if (F.isDeclaration()) {
+    return false;
+  }
+  if (names.empty() && !Annotated) {
+    return true;
+  }
+
+  return names.count(F.getName()) || (Annotated && !readAnnotate(&F).empty());
+}
+
+static Expected<std::unique_ptr<Module>>
+obfuscateLazily(LLVMContext &ctx, const PassPluginLibraryInfo &plugin) {
+  // Big inputs are memory mapped rather than read
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buffer =
+      MemoryBuffer::getFileOrSTDIN(InputFilename);
+  if (!buffer) {
+    return errorCodeToError(buffer.getError());
+  }
+
+  Expected<std::unique_ptr<Module>> M =
+      getOwningLazyBitcodeModule(std::move(*buffer), ctx);
+  if (!M) {
+    return M.takeError();
+  }
+
+  StringSet<> names;
+  for (const std::string &name : Functions) {
+    names.insert(name);
+  }
+
+  {
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassInstrumentationCallbacks PIC;
+    PassBuilder PB(nullptr, PipelineTuningOptions(), {}, &PIC);
+
+    plugin.RegisterPassBuilderCallbacks(PB);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    FunctionPassManager FPM;
+    if (Error err = PB.parsePassPipeline(FPM, PassPipeline)) {
+      return err;
+    }
+    FPM.addPass(VerifierPass());
+
+    for (Function &F : **M) {
+      if (!isSelected(F, names)) {
+        continue;
+      }
+
+      if (Error err = F.materialize()) {
+        return err;
+      }
+      NumMaterialized++;
+      FPM.run(F, FAM);
+    }
+  }
+
+  // The bitcode writer needs every function body
+  if (Error err = (*M)->materializeAll()) {
+    return err;
+  }
+
+  return M;
+}
+
+static int writeModule(Module &M, const char *argv0) {
+  if (verifyModule(M, &errs())) {
+    errs() << argv0 << ": obfuscated module is broken\n";
+    return 1;
+  }
+
+  std::error_code EC;
+  ToolOutputFile out(OutputFilename, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << argv0 << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  if (OutputAssembly) {
+    M.print(out.os(), nullptr);
+  } else {
+    WriteBitcodeToFile(M, out.os());
+  }
+  out.keep();
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "LLVM obfuscation driver\n");
+
+  // Seeds cryptoutils from LLVM_OBF_SEED, as when loaded by clang or opt
+  PassPluginLibraryInfo plugin = llvmGetPassPluginInfo();
+  if (!Seed.empty() && !cryptoutils->prng_seed(Seed)) {
+    return 1;
+  }
+
+  LLVMContext ctx;
+  if (Lazy) {
+    Expected<std::unique_ptr<Module>> M = obfuscateLazily(ctx, plugin);
+    if (!M) {
+      errs() << argv[0] << ": " << toString(M.takeError()) << "\n";
+      return 1;
+    }
+    return writeModule(**M, argv[0]);
+  }
+
+  SMDiagnostic diag;
+  std::unique_ptr<Module> M = parseIRFile(InputFilename, diag, ctx);
+  if (!M) {
+    diag.print(argv[0], errs());
+    return 1;
+  }
+
+  // Check the pipeline before splitting the module
+  {
+    PassBuilder PB;
+    ModulePassManager MPM;
+    plugin.RegisterPassBuilderCallbacks(PB);
+    if (Error err = PB.parsePassPipeline(MPM, PassPipeline)) {
+      errs() << argv[0] << ": " << toString(std::move(err)) << "\n";
+      return 1;
+    }
+  }
+
+  ThreadPoolStrategy strategy = hardware_concurrency(Threads);
+  unsigned partitions =
+      Partitions ? Partitions : strategy.compute_thread_count();
+
+  if (partitions > 1) {
+    M = obfuscateInParallel(std::move(M), partitions, strategy, plugin);
+    if (!M) {
+      return 1;
+    }
+  } else if (Error err = runPipeline(*M, plugin)) {
+    errs() << argv[0] << ": " << toString(std::move(err)) << "\n";
+    return 1;
+  }
+
+  return writeModule(*M, argv[0]);
+}
@@ -19,11 +19,13 @@
 
 #include "CryptoUtils.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/Twine.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <cassert>
@@ -47,9 +49,27 @@ STATISTIC(statsAESEncrypt, "h. Number of calls to aes_encrypt ()");
 using namespace llvm;
 
 namespace llvm {
-ManagedStatic<CryptoUtils> cryptoutils;
+CryptoUtilsHandle cryptoutils;
 }
 
+static ManagedStatic<CryptoUtils> globalCryptoUtils;
+static thread_local CryptoUtils *threadCryptoUtils = nullptr;
+
+CryptoUtils *CryptoUtilsHandle::operator->() const {
+  return threadCryptoUtils ? threadCryptoUtils : &*globalCryptoUtils;
+}
+
+CryptoUtils &CryptoUtilsHandle::operator*() const { return *operator->(); }
+
+CryptoUtils &CryptoUtilsHandle::global() const { return *globalCryptoUtils; }
+
+CryptoUtilsScope::CryptoUtilsScope(CryptoUtils &utils)
+    : previous(threadCryptoUtils) {
+  threadCryptoUtils = &utils;
+}
+
+CryptoUtilsScope::~CryptoUtilsScope() { threadCryptoUtils = previous; }
+
 const uint32_t AES_RCON[10] = {
     0x01000000UL, 0x02000000UL, 0x04000000UL, 0x08000000UL, 0x10000000UL,
     0x20000000UL, 0x40000000UL, 0x80000000UL, 0x1b000000UL, 0x36000000UL};
@@ -495,7 +515,10 @@ const uint32_t masks[32] = {
     0x00000040UL, 0x00000020UL, 0x00000010UL, 0x00000008UL, 0x00000004UL,
     0x00000002UL, 0x00000001UL};
 
-CryptoUtils::CryptoUtils() { seeded = false; }
+CryptoUtils::CryptoUtils() {
+  seeded = false;
+  filled = 0;
+}
 
 unsigned CryptoUtils::scramble32(const unsigned in, const char key[16]) {
   assert(key != NULL && "CryptoUtils::scramble key=NULL");
@@ -596,18 +619,34 @@ void CryptoUtils::populate_pool() {
 
   statsPopulate++;
 
-  for (int i = 0; i < CryptoUtils_POOL_SIZE; i += 16) {
+  // The pool is filled on demand by fill_pool, so that reseeding
+  // (once per function with the cache) does not cost a whole pool
+  filled = 0;
+
+  // Reinitializing the index of the first
+  // available pseudo-random byte
+  idx = 0;
+}
+
+static thread_local std::string traceDetail;
+
+void CryptoUtils::set_trace_detail(const std::string &detail) {
+  traceDetail = detail;
+}
+
+void CryptoUtils::fill_pool(const uint32_t end) {
+  if (filled >= end) {
+    return;
+  }
+
+  for (; filled < end; filled += 16) {
 
     // ctr += 1
     inc_ctr();
 
     // We then encrypt the counter
-    aes_encrypt(pool + i, ctr, ks);
+    aes_encrypt(pool + filled, ctr, ks);
   }
-
-  // Reinitializing the index of the first
-  // available pseudo-random byte
-  idx = 0;
 }
 
 bool CryptoUtils::prng_seed() {
@@ -653,6 +692,37 @@ void CryptoUtils::inc_ctr() {
   STORE64H(ctr + 8, iseed);
 }
 
+std::string CryptoUtils::derive_seed(const std::string &label) {
+  unsigned char hash[32];
+
+  if (!seeded) {
+    prng_seed();
+    populate_pool();
+  }
+
+  std::string msg = toHex(ArrayRef<uint8_t>((const uint8_t *)key, 16)) + label;
+  sha256(msg.c_str(), hash);
+
+  return toHex(ArrayRef<uint8_t>(hash, 16));
+}
+
+uint32_t CryptoUtils::keyed_range(const std::string &label,
+                                  const uint32_t max) {
+  unsigned char hash[32];
+  uint32_t value;
+
+  if (!seeded) {
+    prng_seed();
+    populate_pool();
+  }
+
+  std::string msg = toHex(ArrayRef<uint8_t>((const uint8_t *)key, 16)) + label;
+  sha256(msg.c_str(), hash);
+  LOAD32H(value, hash);
+
+  return value % max;
+}
+
 char *CryptoUtils::get_seed() {
 
   if (seeded) {
@@ -684,10 +754,16 @@ void CryptoUtils::get_bytes(char *buffer, const int len) {
         // We don't have enough bytes ready in the pool,
         // so let's use the available ones and repopulate !
         available = CryptoUtils_POOL_SIZE - idx;
+        {
+          // Traced once per pool, not on each draw filling it lazily
+          TimeTraceScope scope("populate_pool", traceDetail);
+          fill_pool(CryptoUtils_POOL_SIZE);
+        }
         memcpy(buffer + sofar, pool + idx, available);
         sofar += available;
         populate_pool();
       } else {
+        fill_pool(idx + (len - sofar));
         memcpy(buffer + sofar, pool + idx, len - sofar);
         idx += len - sofar;
         // This will trigger a loop exit
@@ -1065,12 +1141,16 @@ int CryptoUtils::sha256_done(sha256_state *md, unsigned char *out) {
 }
 
 int CryptoUtils::sha256(const char *msg, unsigned char *hash) {
+  return sha256(msg, (unsigned long)strlen((const char *)msg), hash);
+}
+
+int CryptoUtils::sha256(const char *msg, unsigned long len,
+                        unsigned char *hash) {
   unsigned char tmp[32];
   sha256_state md;
 
   sha256_init(&md);
-  sha256_process(&md, (const unsigned char *)msg,
-                 (unsigned long)strlen((const char *)msg));
+  sha256_process(&md, (const unsigned char *)msg, len);
   sha256_done(&md, tmp);
 
   memcpy(hash, tmp, 32);
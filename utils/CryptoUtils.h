@@ -27,7 +27,17 @@
 namespace llvm {
 
 class CryptoUtils;
-extern ManagedStatic<CryptoUtils> cryptoutils;
+
+// Accessor for the generator used by the passes: the one installed on the
+// current thread by a CryptoUtilsScope if any, the process-wide one otherwise.
+struct CryptoUtilsHandle {
+  CryptoUtils *operator->() const;
+  CryptoUtils &operator*() const;
+
+  // The process-wide generator, whatever the current thread uses
+  CryptoUtils &global() const;
+};
+extern CryptoUtilsHandle cryptoutils;
 
 #define BYTE(x, n) (((x) >> (8 * (n))) & 0xFF)
 
@@ -249,6 +259,18 @@ public:
   unsigned scramble32(const unsigned in, const char key[16]);
 
   int sha256(const char *msg, unsigned char *hash);
+  int sha256(const char *msg, unsigned long len, unsigned char *hash);
+
+  // Returns a seed suitable for prng_seed(), derived from this generator's
+  // key and label. Used to build independent deterministic streams.
+  std::string derive_seed(const std::string &label);
+  // Returns an integer on [0, max[ that only depends on this generator's key
+  // and label, not on the values drawn so far.
+  uint32_t keyed_range(const std::string &label, const uint32_t max);
+
+  // Detail of the populate_pool time trace entries of this thread, the
+  // function or module the random values are drawn for
+  static void set_trace_detail(const std::string &detail);
 
 private:
   uint32_t ks[44];
@@ -256,6 +278,7 @@ private:
   char ctr[16];
   char pool[CryptoUtils_POOL_SIZE];
   uint32_t idx;
+  uint32_t filled;
   std::string seed;
   bool seeded;
 
@@ -270,12 +293,24 @@ private:
   bool prng_seed();
   void inc_ctr();
   void populate_pool();
+  void fill_pool(const uint32_t end);
   int sha256_done(sha256_state *md, unsigned char *out);
   int sha256_init(sha256_state *md);
   static int sha256_compress(sha256_state *md, unsigned char *buf);
   int sha256_process(sha256_state *md, const unsigned char *in,
                      unsigned long inlen);
 };
+
+// Makes cryptoutils refer to utils on the current thread for the lifetime of
+// the scope, so that passes running concurrently each use their own stream.
+class CryptoUtilsScope {
+public:
+  CryptoUtilsScope(CryptoUtils &utils);
+  ~CryptoUtilsScope();
+
+private:
+  CryptoUtils *previous;
+};
 } // namespace llvm
 
 #endif // LLVM_CryptoUtils_H
@@ -1,11 +1,111 @@
 #include "Utils.h"
+#include "CryptoUtils.h"
+#include "report/Report.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
 #include <sstream>
 
+#define DEBUG_TYPE "fix-stack"
+
+STATISTIC(DemotedValues, "Values demoted to the stack");
+STATISTIC(DemotedPhis, "Phi nodes demoted to the stack");
+STATISTIC(ReloadsReused, "Reloads of demoted values reused");
+STATISTIC(SpillsMerged, "Spills of demoted values merged");
+STATISTIC(SlotsCoalesced, "Stack slots of demoted values coalesced");
+STATISTIC(DeadSpills, "Spills of demoted values never reloaded, removed");
+
 namespace llvm {
 
+static cl::opt<int>
+    Percentage("obf_percentage",
+               cl::desc("Choose the percentage [%] of the functions each pass "
+                        "obfuscates, LLVM_OBF_PERCENTAGE by default"),
+               cl::value_desc("percentage"), cl::init(100), cl::Optional);
+
+int getObfuscationPercentage() {
+  if (Percentage.getNumOccurrences() == 0) {
+    static const int fromEnv = [] {
+      const char *value = getenv("LLVM_OBF_PERCENTAGE");
+      int percentage = 100;
+      if (value != NULL && StringRef(value).getAsInteger(10, percentage)) {
+        percentage = -1;
+      }
+      return percentage;
+    }();
+    return fromEnv;
+  }
+  return Percentage;
+}
+
+static cl::opt<bool> MultiRound(
+    "obf_multi_round",
+    cl::desc("Choose to run the passes again on the functions they already "
+             "obfuscated, LLVM_OBF_MULTI_ROUND by default"),
+    cl::init(false), cl::Optional);
+
+bool isMultiRound() {
+  if (MultiRound.getNumOccurrences() == 0) {
+    static const bool fromEnv = [] {
+      const char *value = getenv("LLVM_OBF_MULTI_ROUND");
+      return value != NULL && StringRef(value) == "y";
+    }();
+    return fromEnv;
+  }
+  return MultiRound;
+}
+
+bool isObfuscated(Function *f, const std::string &attribute) {
+  return !isMultiRound() && f->hasFnAttribute("obf-" + attribute);
+}
+
+void markObfuscated(Function *f, const std::string &attribute) {
+  f->addFnAttr("obf-" + attribute);
+}
+
+// The sample is drawn from a hash of the seed, the pass and the function name
+// rather than from the random stream, so that a function gets the same answer
+// whatever the order, the thread or the partition it is obfuscated in.
+static bool isSampled(Function *f, const std::string &attribute) {
+  int percentage = getObfuscationPercentage();
+  if (percentage < 0 || percentage > 100) {
+    f->getContext().emitError("obfuscation percentage must be 0 <= x <= 100");
+    return false;
+  }
+  if (percentage == 100) {
+    return true;
+  }
+
+  std::string label = "sample:" + attribute + ":" + f->getName().str();
+  return (int)cryptoutils.global().keyed_range(label, 100) < percentage;
+}
+
+static bool noValueNames() {
+  static const bool noNames = [] {
+    const char *value = getenv("LLVM_OBF_NO_NAMES");
+    return value != NULL && StringRef(value) == "y";
+  }();
+  return noNames;
+}
+
+ValueNamesScope::ValueNamesScope(LLVMContext &ctx)
+    : ctx(ctx), discard(ctx.shouldDiscardValueNames()) {
+  if (noValueNames()) {
+    ctx.setDiscardValueNames(true);
+  }
+}
+
+ValueNamesScope::~ValueNamesScope() { ctx.setDiscardValueNames(discard); }
+
 // Shamefully borrowed from ../Scalar/RegToMem.cpp :(
 bool valueEscapes(Instruction *Inst) {
   BasicBlock *BB = Inst->getParent();
@@ -19,10 +119,236 @@ bool valueEscapes(Instruction *Inst) {
   return false;
 }
 
-void fixStack(Function *f) {
+// DemoteRegToStack loads the slot before each use, and stores it after the
+// definition. Only these loads and stores access the slots, so within a block
+// a load is replaced by the last value loaded from or stored to its slot, and
+// a store followed by another one before any load is dropped.
+using SlotSet = SmallSetVector<AllocaInst *, 32>;
+
+static void reuseReloads(Function *f, const SlotSet &slots) {
+  uint64_t reused = 0, merged = 0;
+  DenseMap<AllocaInst *, Value *> available;
+  DenseMap<AllocaInst *, StoreInst *> pending;
+
+  for (BasicBlock &BB : *f) {
+    available.clear();
+    pending.clear();
+    for (auto I = BB.begin(); I != BB.end();) {
+      Instruction *inst = &*I++;
+
+      if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        AllocaInst *slot = dyn_cast<AllocaInst>(load->getPointerOperand());
+        if (slot == NULL || !slots.count(slot) || load->isVolatile()) {
+          continue;
+        }
+        auto it = available.find(slot);
+        if (it != available.end()) {
+          load->replaceAllUsesWith(it->second);
+          load->eraseFromParent();
+          ++reused;
+          continue;
+        }
+        available[slot] = load;
+        pending.erase(slot);
+        continue;
+      }
+
+      if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+        AllocaInst *slot = dyn_cast<AllocaInst>(store->getPointerOperand());
+        if (slot == NULL || !slots.count(slot) || store->isVolatile()) {
+          continue;
+        }
+        StoreInst *&previous = pending[slot];
+        if (previous != NULL) {
+          previous->eraseFromParent();
+          ++merged;
+        }
+        previous = store;
+        available[slot] = store->getValueOperand();
+      }
+    }
+  }
+
+  ReloadsReused += reused;
+  SpillsMerged += merged;
+  reportCount("fix_stack_reloads_reused", reused);
+  reportCount("fix_stack_spills_merged", merged);
+}
+
+// The slot of the pointer operand of I if it is a load or a store of a slot
+static int slotAccess(Instruction &I, const DenseMap<Value *, int> &index) {
+  Value *pointer = NULL;
+  if (LoadInst *load = dyn_cast<LoadInst>(&I)) {
+    pointer = load->getPointerOperand();
+  } else if (StoreInst *store = dyn_cast<StoreInst>(&I)) {
+    pointer = store->getPointerOperand();
+  }
+  auto it = index.find(pointer);
+  return it == index.end() ? -1 : it->second;
+}
+
+// Liveness of the slots over the blocks as they run (flow, or the branches),
+// then the slots not live at the same time share an alloca, greedily in
+// demotion order. A store of a slot not live after it is dead and removed.
+// The remaining ones start the lifetime of the slot, and the loads it is not
+// live after end it: the markers let the backend stack coloring pack the
+// allocas left further.
+static void coalesceSlots(Function *f, const SlotSet &slots,
+                          const BlockFlow *flow) {
+  const DataLayout &DL = f->getParent()->getDataLayout();
+  unsigned n = slots.size();
+  DenseMap<Value *, int> index;
+  for (unsigned i = 0; i < n; ++i) {
+    index[slots[i]] = i;
+  }
+
+  auto successors = [&](BasicBlock *BB) {
+    SmallVector<BasicBlock *, 2> succs;
+    auto it = flow ? flow->find(BB) : BlockFlow::const_iterator();
+    if (flow && it != flow->end()) {
+      succs.append(it->second.begin(), it->second.end());
+    } else {
+      succs.append(succ_begin(BB), succ_end(BB));
+    }
+    return succs;
+  };
+
+  // Loads before any store, and stores, of each block
+  DenseMap<BasicBlock *, unsigned> blockIndex;
+  std::vector<BasicBlock *> blocks;
+  std::vector<BitVector> gen, kill, liveIn;
+  for (BasicBlock &BB : *f) {
+    blockIndex[&BB] = blocks.size();
+    blocks.push_back(&BB);
+    gen.emplace_back(n);
+    kill.emplace_back(n);
+    liveIn.emplace_back(n);
+    for (Instruction &I : BB) {
+      int slot = slotAccess(I, index);
+      if (slot < 0) {
+        continue;
+      }
+      if (isa<LoadInst>(I) && !kill.back().test(slot)) {
+        gen.back().set(slot);
+      } else if (isa<StoreInst>(I)) {
+        kill.back().set(slot);
+      }
+    }
+  }
+
+  auto liveOut = [&](BasicBlock *BB) {
+    BitVector live(n);
+    for (BasicBlock *succ : successors(BB)) {
+      live |= liveIn[blockIndex[succ]];
+    }
+    return live;
+  };
+
+  bool changed;
+  do {
+    changed = false;
+    for (unsigned b = blocks.size(); b-- > 0;) {
+      BitVector live = liveOut(blocks[b]);
+      live.reset(kill[b]);
+      live |= gen[b];
+      if (live != liveIn[b]) {
+        liveIn[b] = std::move(live);
+        changed = true;
+      }
+    }
+  } while (changed);
+
+  // A store interferes with the slots live at it
+  std::vector<BitVector> interference(n, BitVector(n));
+  SmallVector<std::pair<Instruction *, unsigned>, 32> starts, ends;
+  SmallVector<Instruction *, 16> deadStores;
+  for (BasicBlock &BB : *f) {
+    BitVector live = liveOut(&BB);
+    for (auto I = BB.rbegin(); I != BB.rend(); ++I) {
+      int slot = slotAccess(*I, index);
+      if (slot < 0) {
+        continue;
+      }
+      if (isa<LoadInst>(*I)) {
+        if (!live.test(slot)) {
+          ends.push_back({&*I, slot});
+        }
+        live.set(slot);
+        continue;
+      }
+      if (!live.test(slot)) {
+        deadStores.push_back(&*I);
+        continue;
+      }
+      live.reset(slot);
+      interference[slot] |= live;
+      for (unsigned other : live.set_bits()) {
+        interference[other].set(slot);
+      }
+      starts.push_back({&*I, slot});
+    }
+  }
+
+  for (Instruction *store : deadStores) {
+    store->eraseFromParent();
+  }
+  DeadSpills += deadStores.size();
+
+  // Greedy coloring, a color being an alloca of the type
+  uint64_t before = 0, after = 0;
+  SmallVector<AllocaInst *, 32> colors;
+  SmallVector<BitVector, 32> members;
+  SmallVector<AllocaInst *, 32> assigned;
+  for (unsigned i = 0; i < n; ++i) {
+    AllocaInst *slot = slots[i];
+    uint64_t size = DL.getTypeAllocSize(slot->getAllocatedType());
+    before += size;
+
+    unsigned c = 0;
+    for (; c < colors.size(); ++c) {
+      if (colors[c]->getAllocatedType() == slot->getAllocatedType() &&
+          !interference[i].anyCommon(members[c])) {
+        break;
+      }
+    }
+    if (c == colors.size()) {
+      colors.push_back(slot);
+      members.emplace_back(n);
+      after += size;
+    } else {
+      AllocaInst *color = colors[c];
+      if (slot->getAlign() > color->getAlign()) {
+        color->setAlignment(slot->getAlign());
+      }
+      slot->replaceAllUsesWith(color);
+      slot->eraseFromParent();
+      ++SlotsCoalesced;
+    }
+    members[c].set(i);
+    assigned.push_back(colors[c]);
+  }
+
+  for (auto &start : starts) {
+    IRBuilder<> builder(start.first);
+    builder.CreateLifetimeStart(assigned[start.second]);
+  }
+  for (auto &end : ends) {
+    IRBuilder<> builder(end.first->getNextNode());
+    builder.CreateLifetimeEnd(assigned[end.second]);
+  }
+
+  reportCount("fix_stack_slots", colors.size());
+  reportCount("fix_stack_bytes_before", before);
+  reportCount("fix_stack_bytes_after", after);
+}
+
+void fixStack(Function *f, const BlockFlow *flow) {
+  TimeTraceScope scope("fixStack", f->getName());
+
   // Try to remove phi node and demote reg to stack
   std::vector<PHINode *> tmpPhi;
   std::vector<Instruction *> tmpReg;
+  SlotSet slots;
   BasicBlock *bbEntry = &*f->begin();
 
   do {
@@ -45,15 +371,30 @@ void fixStack(Function *f) {
         }
       }
     }
+    // A value or phi without uses is erased instead, with no slot
     for (unsigned int i = 0; i != tmpReg.size(); ++i) {
-      DemoteRegToStack(*tmpReg.at(i), false);
+      if (AllocaInst *slot = DemoteRegToStack(*tmpReg.at(i), false)) {
+        slots.insert(slot);
+      }
     }
 
     for (unsigned int i = 0; i != tmpPhi.size(); ++i) {
-      DemotePHIToStack(tmpPhi.at(i), f->begin()->getTerminator()->getIterator());
+      if (AllocaInst *slot = DemotePHIToStack(
+              tmpPhi.at(i), f->begin()->getTerminator()->getIterator())) {
+        slots.insert(slot);
+      }
     }
 
+    DemotedValues += tmpReg.size();
+    DemotedPhis += tmpPhi.size();
+    reportCount("fix_stack_allocas", tmpReg.size() + tmpPhi.size());
+
   } while (tmpReg.size() != 0 || tmpPhi.size() != 0);
+
+  reuseReloads(f, slots);
+  if (!slots.empty()) {
+    coalesceSlots(f, slots, flow);
+  }
 }
 
 std::string readAnnotate(Function *f) {
@@ -126,24 +467,10 @@ bool toObfuscate(bool flag, Function *f, std::string attribute) {
     return true;
   }
 
-  // If fla flag is set
+  // If fla flag is set, only a sample of the functions when a percentage is
+  // given
   if (flag == true) {
-    /* Check if the number of applications is correct
-    if (!((Percentage > 0) && (Percentage <= 100))) {
-      LLVMContext &ctx = llvm::getGlobalContext();
-      ctx.emitError(Twine("Flattening application function\
-              percentage -perFLA=x must be 0 < x <= 100"));
-    }
-    // Check name
-    else if (func.size() != 0 && func.find(f->getName()) != std::string::npos) {
-      return true;
-    }
-
-    if ((((int)llvm::cryptoutils->get_range(100))) < Percentage) {
-      return true;
-    }
-    */
-    return true;
+    return isSampled(f, attr);
   }
 
   return false;
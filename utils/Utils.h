@@ -1,15 +1,50 @@
 #ifndef __UTILS_OBF__
 #define __UTILS_OBF__
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Transforms/Utils/Local.h" // For DemoteRegToStack and DemotePHIToStack
 #include <stdio.h>
 
 namespace llvm {
-void fixStack(Function *f);
+/* ValueNamesScope
+ *
+ * While alive, instructions and basic blocks created in the context are left
+ * unnamed if the environment variable LLVM_OBF_NO_NAMES is set to "y". This
+ * saves a symbol table insertion and a name uniquing per created value.
+ */
+struct ValueNamesScope {
+  ValueNamesScope(LLVMContext &ctx);
+  ~ValueNamesScope();
+
+  LLVMContext &ctx;
+  bool discard;
+};
+
+// Successors of the blocks as they run, when they differ from the branches:
+// flattening goes through the dispatcher to the original successors
+using BlockFlow = DenseMap<BasicBlock *, SmallVector<BasicBlock *, 2>>;
+
+// Demotes the values used outside their block and the phis to the stack. The
+// slots of the values never live at the same time, as far as flow tells,
+// share an alloca.
+void fixStack(Function *f, const BlockFlow *flow = nullptr);
 std::string readAnnotate(Function *f);
 bool toObfuscate(bool flag, Function *f, std::string attribute);
+// Percentage of the functions toObfuscate selects without annotation, from
+// -obf_percentage or LLVM_OBF_PERCENTAGE
+int getObfuscationPercentage();
+// Whether the passes run again on the functions they already transformed,
+// from -obf_multi_round or LLVM_OBF_MULTI_ROUND
+bool isMultiRound();
+// Whether the pass of attribute already transformed f and should skip it, an
+// extension point like the peephole one running the passes several times
+bool isObfuscated(Function *f, const std::string &attribute);
+// Tag f as transformed by the pass of attribute, with the obf-<attribute>
+// function attribute
+void markObfuscated(Function *f, const std::string &attribute);
 } // namespace llvm
 
 #endif